@@ -0,0 +1,69 @@
+#define _GNU_SOURCE     //sched_setaffinity()
+#include "affinity.h"
+#include "log.h"
+#include <sched.h>
+
+#define NODE_CPULIST_PATH "/sys/devices/system/node/node%d/cpulist"
+
+static int cpus[CPU_SETSIZE];
+static int cpu_num = 0;
+
+void add_cpu(cpu_set_t *allowed, int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)) return;
+    CPU_CLR(cpu, allowed);
+    cpus[cpu_num++] = cpu;
+}
+
+//cpulist of a node looks like "0-3,8-11", returns -1 if the node doesn't exist
+int add_node_cpus(cpu_set_t *allowed, int node) {
+    char path[sizeof(NODE_CPULIST_PATH) + 16];
+    int first, last, cpu;
+    FILE *file;
+    snprintf(path, sizeof(path), NODE_CPULIST_PATH, node);
+    if ((file = fopen(path, "r")) == NULL) return -1;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        fscanf(file, "-%d", &last);
+        for (cpu = first; cpu <= last; cpu++) {
+            add_cpu(allowed, cpu);
+        }
+        if (fgetc(file) != ',') break;
+    }
+    fclose(file);
+    return 0;
+}
+
+int affinity_init() {
+    cpu_set_t allowed;
+    int node, cpu, node_num = 0;
+    cpu_num = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        LOG_ERROR("sched_getaffinity() failed: %s", strerror(errno));
+        return -1;
+    }
+    for (node = 0; add_node_cpus(&allowed, node) == 0; node++) {
+        node_num++;
+    }
+    //kernels without NUMA support have no nodes in sysfs
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        add_cpu(&allowed, cpu);
+    }
+    if (cpu_num == 0) return -1;
+    LOG_INFO("Threads are pinned to %d CPUs of %d NUMA nodes", cpu_num, node_num > 0 ? node_num : 1);
+    return 0;
+}
+
+int pin_current_thread(int index) {
+    cpu_set_t set;
+    int cpu;
+    if (cpu_num == 0) return -1;
+    cpu = cpus[index % cpu_num];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        LOG_WARN("Couldn't pin thread to CPU %d: %s", cpu, strerror(errno));
+        return -1;
+    }
+    LOG_DEBUG("Thread %d is pinned to CPU %d", index, cpu);
+    return 0;
+}
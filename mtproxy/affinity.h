@@ -0,0 +1,18 @@
+/*
+ * Pinning of the worker threads and reactors to CPUs. CPUs are numbered in the order of their NUMA nodes,
+ * so threads with close indexes share a node. Memory is placed by the first touch of the kernel
+ * and glibc gives every thread its own arena, so memory a pinned thread allocates and fills itself
+ * stays on the node of its CPU.
+ * */
+#ifndef PROXY_AFFINITY_H
+#define PROXY_AFFINITY_H
+
+#include "consts.h"
+
+//reads the CPUs the proxy is allowed to run on, returns -1 if there are none
+int affinity_init();
+
+//pins the calling thread to the CPU of the index, indexes beyond the number of CPUs wrap around
+int pin_current_thread(int index);
+
+#endif //PROXY_AFFINITY_H
@@ -1,9 +1,20 @@
 #include "arrayset.h"
+#include "log.h"
 
 void arrayset_init(struct arrayset *set) {
     set->arr = NULL;
     set->arr_size = 0;
     set->data_size = 0;
+    set->index_offset = ARRAY_SET_NO_INDEX;
+}
+
+void arrayset_init_indexed(struct arrayset *set, size_t index_offset) {
+    arrayset_init(set);
+    set->index_offset = (ssize_t) index_offset;
+}
+
+int *element_index(struct arrayset *set, void *element) {
+    return (int *) ((char *) element + set->index_offset);
 }
 
 int arrayset_add(struct arrayset *set, void *element) {
@@ -11,25 +22,32 @@ int arrayset_add(struct arrayset *set, void *element) {
         set->arr_size += (set->arr_size == 0 ? 1 : set->arr_size);
         set->arr = (void **)realloc(set->arr, set->arr_size * sizeof(void*));
         if (set->arr == NULL) {
-            fprintf(stderr, "Couldn't allocate memory of size %d, for arrayset: %s\n", set->arr_size, strerror(errno));
+            LOG_ERROR("Couldn't allocate memory of size %d, for arrayset: %s", set->arr_size, strerror(errno));
             return -1;
         }
     }
     set->arr[set->data_size] = element;
+    if (set->index_offset != ARRAY_SET_NO_INDEX) *element_index(set, element) = set->data_size;
     set->data_size++;
     return 0;
 }
 
 int arrayset_remove(struct arrayset *set, void *element) {
     int i;
-    for (i = 0; i < set->data_size; i++) {
-        if (set->arr[i] == element) {
-            set->data_size--;
-            set->arr[i] = set->arr[set->data_size];
-            return 0;
-        }
+    if (set->index_offset != ARRAY_SET_NO_INDEX) {
+        i = *element_index(set, element);
+        if (i < 0 || i >= set->data_size || set->arr[i] != element) return -1;
+    } else {
+        for (i = 0; i < set->data_size && set->arr[i] != element; i++);
+        if (i == set->data_size) return -1;
     }
-    return -1;
+    set->data_size--;
+    set->arr[i] = set->arr[set->data_size];
+    if (set->index_offset != ARRAY_SET_NO_INDEX) {
+        *element_index(set, set->arr[i]) = i;
+        *element_index(set, element) = -1;
+    }
+    return 0;
 }
 
 void arrayset_free(struct arrayset *set, void (*free_element) (void*)) {
@@ -38,5 +56,7 @@ void arrayset_free(struct arrayset *set, void (*free_element) (void*)) {
         free_element(set->arr[i]);
     }
     free(set->arr);
-    arrayset_init(set);
+    set->arr = NULL;
+    set->arr_size = 0;
+    set->data_size = 0;
 }
\ No newline at end of file
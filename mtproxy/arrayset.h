@@ -4,21 +4,32 @@
  * If the array is full, then it's reallocated with twice the size.
  * When you delete an element, then the last element is placed instead of
  * the deleted element, so that the array doesn't have holes.
+ *
+ * Elements of an indexed set keep their slot in an int member, the set updates it when an element moves,
+ * so an element is removed in O(1) instead of being searched for. Such an element is in one indexed set at a time.
  * */
 #ifndef MY_ARRAY_SET
 #define MY_ARRAY_SET
 #include "consts.h"
+#include <stddef.h>
 
-#define ARRAY_SET_INITIALIZER { NULL, 0, 0 }
+#define ARRAY_SET_NO_INDEX -1
+
+#define ARRAY_SET_INITIALIZER { NULL, 0, 0, ARRAY_SET_NO_INDEX }
+#define ARRAY_SET_INDEXED_INITIALIZER(type, member) { NULL, 0, 0, offsetof(type, member) }
 
 struct arrayset {
     void **arr;
     int data_size;  //number of elements
     int arr_size;   //size of the allocated array
+    ssize_t index_offset;   //offset of the int member holding the slot of an element, ARRAY_SET_NO_INDEX if none
 };
 
 void arrayset_init(struct arrayset *set);
 
+//index_offset is offsetof() the int member of the elements, it's set to -1 when an element is removed
+void arrayset_init_indexed(struct arrayset *set, size_t index_offset);
+
 int arrayset_add(struct arrayset *set, void *element);
 
 int arrayset_remove(struct arrayset *set, void *element);
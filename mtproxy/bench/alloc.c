@@ -0,0 +1,185 @@
+/*
+ * Counts heap allocations of the scheduling paths of the thread pool and of the request buffer cycle of a client.
+ * malloc() and its siblings are wrapped by the linker (-Wl,--wrap), so the calls of the proxy sources are counted.
+ * Every path is warmed up first, then it's run op_num times and must not allocate or free anything:
+ * tasks are stored by value in the slots of the global queue and in the deques of the workers,
+ * and emptied request buffers keep their memory.
+ * Usage: alloc [operations], 1000000 by default. Exits with 1 if a steady state path touches the heap.
+ * */
+#include "threadpool.h"
+#include "realloc_buffer.h"
+#include "lock.h"
+#include "log.h"
+#include "check.h"
+
+#define BATCH 1000                          //tasks queued before they are run, below THREAD_POOL_QUEUE_SIZE
+#define TASKS_BATCH 64                      //tasks of one thread_pool_add_tasks()
+#define CHILD_NUM 32
+#define WORKER_NUM 2
+#define REQUEST_LEN 500
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+void __real_free(void *ptr);
+
+//workers allocate too, so the counters are atomic
+unsigned long alloc_num, free_num;
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&alloc_num, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+    __atomic_add_fetch(&alloc_num, 1, __ATOMIC_RELAXED);
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_num, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size) {
+    __atomic_add_fetch(&alloc_num, 1, __ATOMIC_RELAXED);
+    return __real_posix_memalign(ptr, alignment, size);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr != NULL) __atomic_add_fetch(&free_num, 1, __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+long op_num;
+long run_num;
+double start;
+struct thread_pool pool;
+
+void task(void *arg) {
+    (void) arg;
+    __atomic_add_fetch(&run_num, 1, __ATOMIC_RELAXED);
+}
+
+void begin() {
+    __atomic_store_n(&alloc_num, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&free_num, 0, __ATOMIC_RELAXED);
+    run_num = 0;
+    start = now();
+}
+
+//prints the counts per operation and fails if there are any
+void end(const char *name, long count) {
+    double elapsed = now() - start;
+    unsigned long allocs = __atomic_load_n(&alloc_num, __ATOMIC_RELAXED);
+    unsigned long frees = __atomic_load_n(&free_num, __ATOMIC_RELAXED);
+    printf("%-32s allocs %.4f  frees %.4f  %6.1f ns/op\n", name,
+           (double) allocs / count, (double) frees / count, elapsed * 1e9 / count);
+    CHECK(allocs == 0 && frees == 0, "%s made %lu allocations and %lu frees", name, allocs, frees);
+}
+
+void add_task_cycle(long count) {
+    long i, j;
+    for (i = 0; i < count / BATCH; i++) {
+        for (j = 0; j < BATCH; j++) {
+            CHECK(thread_pool_add_task(&pool, task, NULL) == 0, "task not added");
+        }
+        thread_pool_run(&pool);
+    }
+}
+
+void add_tasks_cycle(long count) {
+    struct thread_pool_task tasks[TASKS_BATCH];
+    long i;
+    for (i = 0; i < TASKS_BATCH; i++) {
+        tasks[i].task = task;
+        tasks[i].args = NULL;
+    }
+    for (i = 0; i < count / TASKS_BATCH; i++) {
+        CHECK(thread_pool_add_tasks(&pool, tasks, TASKS_BATCH, THREAD_POOL_PRIORITY_NORMAL) == TASKS_BATCH,
+              "tasks not added");
+        thread_pool_run(&pool);
+    }
+}
+
+//runs on a worker, so the tasks it adds go to its deque
+void parent(void *arg) {
+    long i;
+    (void) arg;
+    for (i = 0; i < CHILD_NUM; i++) {
+        CHECK(thread_pool_add_local_task(&pool, task, NULL) == 0, "local task not added");
+    }
+}
+
+//parents are added from outside the workers, the children of a batch are run before the next one is added
+void worker_cycle(long count) {
+    long i, j, parent_num = BATCH / CHILD_NUM, target = __atomic_load_n(&run_num, __ATOMIC_RELAXED);
+    for (i = 0; i < count / (parent_num * CHILD_NUM); i++) {
+        for (j = 0; j < parent_num; j++) {
+            CHECK(thread_pool_add_task(&pool, parent, NULL) == 0, "parent not added");
+        }
+        target += parent_num * CHILD_NUM;
+        while (__atomic_load_n(&run_num, __ATOMIC_RELAXED) < target) sched_yield();
+    }
+}
+
+//a request and the start of the next pipelined one are received, the parsed request is removed
+void request_cycle(struct realloc_buffer *buffer, long count) {
+    char request[REQUEST_LEN + REQUEST_LEN / 2];
+    long i;
+    memset(request, 'a', sizeof(request));
+    for (i = 0; i < count; i++) {
+        CHECK(realloc_buffer_add_bytes(buffer, request, (int) (buffer->data_len == 0 ? sizeof(request) : REQUEST_LEN))
+              == 0, "bytes not added");
+        CHECK(realloc_buffer_remove_bytes_at_start(buffer, REQUEST_LEN) == 0, "bytes not removed");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct realloc_buffer buffer;
+    int i;
+    op_num = (argc > 1 ? atol(argv[1]) : 1000000);
+    CHECK(op_num >= BATCH, "at least %d operations are needed", BATCH);
+    lock_ops = &pthread_lock_ops;
+    setenv(LOG_LEVEL_ENV, "warn", 0);
+    CHECK(log_init(1) == 0, "log not started");
+
+    //the pool allocates its queue, so a count of 0 below can't be because malloc isn't wrapped
+    begin();
+    CHECK(thread_pool_init(&pool, 0, 0, 0) == 0, "pool of 0 threads not started");
+    CHECK(alloc_num > 0, "malloc isn't wrapped");
+    add_task_cycle(BATCH);
+    begin();
+    add_task_cycle(op_num);
+    end("thread_pool_add_task", op_num);
+    add_tasks_cycle(BATCH);
+    begin();
+    add_tasks_cycle(op_num);
+    end("thread_pool_add_tasks", op_num);
+    thread_pool_shut_down(&pool, 0);
+    thread_pool_destroy(&pool);
+
+    //workers allocate their deques when they start, one of them may start after the warm up is over
+    CHECK(thread_pool_init(&pool, WORKER_NUM, WORKER_NUM, 0) == 0, "pool of %d threads not started", WORKER_NUM);
+    for (i = 0; i < WORKER_NUM; i++) {
+        while (__atomic_load_n(pool.workers + i, __ATOMIC_ACQUIRE) == NULL) usleep(100);
+    }
+    run_num = 0;
+    worker_cycle(BATCH);
+    begin();
+    worker_cycle(op_num);
+    end("thread_pool_add_local_task", run_num);
+    thread_pool_shut_down(&pool, 0);
+    thread_pool_destroy(&pool);
+
+    realloc_buffer_init(&buffer);
+    request_cycle(&buffer, 2);
+    begin();
+    request_cycle(&buffer, op_num);
+    end("request buffer add and remove", op_num);
+    realloc_buffer_destroy(&buffer);
+
+    log_shutdown();
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Helpers of the benchmarks: CHECK() prints the failed check and exits with 1, now() is monotonic time in seconds.
+ * */
+#ifndef PROXY_CHECK_H
+#define PROXY_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CHECK(condition, ...) do {                                                                  \
+    if (!(condition)) {                                                                             \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__);                                      \
+        fprintf(stderr, __VA_ARGS__);                                                               \
+        fprintf(stderr, "\n");                                                                      \
+        exit(1);                                                                                    \
+    }                                                                                               \
+} while (0)
+
+static inline double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+#endif //PROXY_CHECK_H
@@ -0,0 +1,204 @@
+/*
+ * Microbenchmark of the intrusive FIFO and the SPSC/MPSC rings against a list that mallocs a node per element,
+ * the way queue_add()/queue_pop() of the removed queue.c did. Every run checks the order of the popped elements,
+ * so it fails with 1 if a queue loses, repeats or reorders them.
+ * Usage: queues [operations], 10000000 by default.
+ * */
+#include "fifo.h"
+#include "ring.h"
+#include "check.h"
+
+#define BATCH 64                            //elements pushed before they are popped in one thread
+#define RING_SIZE 1024
+#define PRODUCER_NUM 4
+
+struct element {
+    long value;
+    struct fifo_link link;
+};
+
+//baseline, a node is allocated by every push and freed by every pop
+struct list_node {
+    struct list_node *next, *prev;
+    void *value;
+};
+
+struct list {
+    struct list_node *first, *last;
+};
+
+int list_push(struct list *list, void *value) {
+    struct list_node *node = (struct list_node *) malloc(sizeof(struct list_node));
+    if (node == NULL) return -1;
+    node->value = value;
+    node->next = NULL;
+    node->prev = list->last;
+    if (list->first == NULL) {
+        list->first = node;
+    } else {
+        list->last->next = node;
+    }
+    list->last = node;
+    return 0;
+}
+
+void *list_pop(struct list *list) {
+    struct list_node *node = list->first;
+    void *value;
+    if (node == NULL) return NULL;
+    value = node->value;
+    list->first = node->next;
+    if (list->first == NULL) {
+        list->last = NULL;
+    } else {
+        list->first->prev = NULL;
+    }
+    free(node);
+    return value;
+}
+
+long op_num;
+struct element elements[BATCH];
+struct spsc_ring spsc;
+struct mpsc_ring mpsc;
+
+void report(const char *name, double start) {
+    printf("%-28s %6.1f ns/op\n", name, (now() - start) * 1e9 / op_num);
+}
+
+void bench_list() {
+    struct list list = {NULL, NULL};
+    double start = now();
+    long i, j;
+    for (i = 0; i < op_num / BATCH; i++) {
+        for (j = 0; j < BATCH; j++) {
+            CHECK(list_push(&list, elements + j) == 0, "list push failed");
+        }
+        for (j = 0; j < BATCH; j++) {
+            CHECK(((struct element *) list_pop(&list))->value == j, "list popped out of order");
+        }
+    }
+    report("malloc list push/pop", start);
+}
+
+void bench_fifo() {
+    struct fifo fifo = FIFO_INITIALIZER;
+    double start = now();
+    long i, j;
+    for (i = 0; i < op_num / BATCH; i++) {
+        for (j = 0; j < BATCH; j++) {
+            fifo_push(&fifo, &elements[j].link);
+        }
+        for (j = 0; j < BATCH; j++) {
+            CHECK(FIFO_ENTRY(fifo_pop(&fifo), struct element, link)->value == j, "fifo popped out of order");
+        }
+        CHECK(fifo_is_empty(&fifo) && fifo_pop(&fifo) == NULL, "fifo isn't empty");
+    }
+    report("fifo push/pop", start);
+}
+
+void bench_rings_one_thread() {
+    double start = now();
+    void *value;
+    long i, j;
+    for (i = 0; i < op_num / BATCH; i++) {
+        for (j = 0; j < BATCH; j++) {
+            CHECK(spsc_ring_push(&spsc, elements + j) == 0, "spsc push failed");
+        }
+        for (j = 0; j < BATCH; j++) {
+            CHECK(spsc_ring_pop(&spsc, &value) == 0 && ((struct element *) value)->value == j, "spsc popped out of order");
+        }
+    }
+    report("spsc push/pop, 1 thread", start);
+    start = now();
+    for (i = 0; i < op_num / BATCH; i++) {
+        for (j = 0; j < BATCH; j++) {
+            CHECK(mpsc_ring_push(&mpsc, elements + j) == 0, "mpsc push failed");
+        }
+        for (j = 0; j < BATCH; j++) {
+            CHECK(mpsc_ring_pop(&mpsc, &value) == 0 && ((struct element *) value)->value == j, "mpsc popped out of order");
+        }
+    }
+    report("mpsc push/pop, 1 thread", start);
+}
+
+//values carry the position, so the consumer checks that nothing is lost or reordered
+void *spsc_producer(void *arg) {
+    long i;
+    (void) arg;
+    for (i = 0; i < op_num; i++) {
+        while (spsc_ring_push(&spsc, (void *) i) != 0) sched_yield();
+    }
+    return NULL;
+}
+
+//values carry the producer and its position, pushes of one producer must be popped in order
+void *mpsc_producer(void *arg) {
+    long producer = (long) arg, i;
+    for (i = 0; i < op_num / PRODUCER_NUM; i++) {
+        while (mpsc_ring_push(&mpsc, (void *) (i * PRODUCER_NUM + producer)) != 0) sched_yield();
+    }
+    return NULL;
+}
+
+void bench_rings_threads() {
+    pthread_t threads[PRODUCER_NUM];
+    long i, value, next[PRODUCER_NUM] = {0};
+    void *popped;
+    double start = now();
+    pthread_create(threads, NULL, spsc_producer, NULL);
+    for (i = 0; i < op_num; i++) {
+        while (spsc_ring_pop(&spsc, &popped) != 0) sched_yield();
+        CHECK((long) popped == i, "spsc popped %ld instead of %ld", (long) popped, i);
+    }
+    pthread_join(threads[0], NULL);
+    report("spsc 1 -> 1 threads", start);
+
+    start = now();
+    for (i = 0; i < PRODUCER_NUM; i++) {
+        pthread_create(threads + i, NULL, mpsc_producer, (void *) i);
+    }
+    for (i = 0; i < op_num / PRODUCER_NUM * PRODUCER_NUM; i++) {
+        while (mpsc_ring_pop(&mpsc, &popped) != 0) sched_yield();
+        value = (long) popped;
+        CHECK(value / PRODUCER_NUM == next[value % PRODUCER_NUM]++, "mpsc reordered pushes of a producer");
+    }
+    for (i = 0; i < PRODUCER_NUM; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report("mpsc 4 -> 1 threads", start);
+}
+
+//full ring rejects the push, empty one rejects the pop
+void check_bounds() {
+    void *value;
+    int i;
+    CHECK(spsc_ring_pop(&spsc, &value) == -1 && mpsc_ring_pop(&mpsc, &value) == -1, "empty ring popped");
+    for (i = 0; i < RING_SIZE; i++) {
+        CHECK(spsc_ring_push(&spsc, NULL) == 0 && mpsc_ring_push(&mpsc, NULL) == 0, "ring full too early");
+    }
+    CHECK(spsc_ring_push(&spsc, NULL) == -1 && mpsc_ring_push(&mpsc, NULL) == -1, "full ring pushed");
+    for (i = 0; i < RING_SIZE; i++) {
+        CHECK(spsc_ring_pop(&spsc, &value) == 0 && mpsc_ring_pop(&mpsc, &value) == 0, "ring empty too early");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct spsc_ring odd;
+    int i;
+    op_num = (argc > 1 ? atol(argv[1]) : 10000000);
+    CHECK(op_num >= BATCH, "at least %d operations are needed", BATCH);
+    for (i = 0; i < BATCH; i++) {
+        elements[i].value = i;
+    }
+    CHECK(spsc_ring_init(&odd, 1000) == -1, "ring of not a power of two created");
+    CHECK(spsc_ring_init(&spsc, RING_SIZE) == 0 && mpsc_ring_init(&mpsc, RING_SIZE) == 0, "rings not created");
+    check_bounds();
+    bench_list();
+    bench_fifo();
+    bench_rings_one_thread();
+    bench_rings_threads();
+    spsc_ring_destroy(&spsc);
+    mpsc_ring_destroy(&mpsc);
+    return 0;
+}
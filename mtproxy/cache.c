@@ -1,4 +1,5 @@
 #include "cache.h"
+#include "log.h"
 
 
 
@@ -7,11 +8,10 @@ int update_time_func(struct timeval *time) {
 }
 
 int cache_map_init(struct cache_map *cache_map) {
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    int res = pthread_mutex_init(&cache_map->mutex, NULL);
-    if (res < 0) return res;
-#endif
-    arrayset_init(&cache_map->arrayset);
+    int res = MUTEX_INIT(&cache_map->mutex);
+    if (res != 0) return res;
+    cache_map->max_size = DEFAULT_CACHE_MAP_SIZE;
+    arrayset_init_indexed(&cache_map->arrayset, offsetof(struct cache, map_index));
     return 0;
 }
 
@@ -30,67 +30,57 @@ int remove_oldest_cache(struct cache_map *cache_map) {
     if (latest_cache == NULL) {
         return -1;
     }
-    arrayset_remove(&cache_map->arrayset, cache);
-    cache_release(&cache);
-    puts("Oldest cache removed");
+    arrayset_remove(&cache_map->arrayset, latest_cache);
+    cache_release(&latest_cache);
+    LOG_DEBUG("Oldest cache removed");
     return 0;
 }
 
 struct cache *cache_map_get_or_create(struct cache_map *cache_map, char *key, int *cache_flag) {
     int i;
     struct cache *cache = NULL;
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_lock(&cache_map->mutex);
-#endif
-    puts("Looking for cache in cache map");
-    puts(key);
-    puts("---------");
+    MUTEX_LOCK(&cache_map->mutex);
+    LOG_DEBUG("Looking for cache in cache map");
+    LOG_DEBUG("%s", key);
+    LOG_DEBUG("---------");
     for (i = 0; i < cache_map->arrayset.data_size; i++) {
         cache = (struct cache *) cache_map->arrayset.arr[i];
-        puts(cache->key);
+        LOG_DEBUG("%s", cache->key);
         if (strcmp(key, cache->key) == 0) {
             *cache_flag = CACHE_FOUND;
             break;
         }
         cache = NULL;
     }
-    puts("---------");
+    LOG_DEBUG("---------");
     if (cache == NULL) {
-        puts("No cache found");
-        if (cache_map->arrayset.data_size == CACHE_MAP_SIZE && remove_oldest_cache(cache_map) != 0) {
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-            pthread_mutex_unlock(&cache_map->mutex);
-#endif
-            fprintf(stderr, "Couldn't add new cache to map because cache map is full\n");
+        LOG_DEBUG("No cache found");
+        if (cache_map->arrayset.data_size >= cache_map->max_size && remove_oldest_cache(cache_map) != 0) {
+            MUTEX_UNLOCK(&cache_map->mutex);
+            LOG_ERROR("Couldn't add new cache to map because cache map is full");
             return NULL;
         }
         cache = cache_create(key);
         *cache_flag = CACHE_CREATED;
         if (cache == NULL) {
-            perror("Couldn't create cache");
+            LOG_ERROR("Couldn't create cache: %s", strerror(errno));
         } else {
             arrayset_add(&cache_map->arrayset, cache);
         }
     }
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_unlock(&cache_map->mutex);
-#endif
+    MUTEX_UNLOCK(&cache_map->mutex);
     if (cache != NULL) cache_add_user(cache);
     return cache;
 }
 
 int cache_map_remove(struct cache_map *cache_map, struct cache *cache) {
     int res;
-    puts("Removing element from cache map");
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_lock(&cache_map->mutex);
-#endif
+    LOG_DEBUG("Removing element from cache map");
+    MUTEX_LOCK(&cache_map->mutex);
     res = arrayset_remove(&cache_map->arrayset, cache);
     if (res == 0)
         cache_release(&cache);
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_unlock(&cache_map->mutex);
-#endif
+    MUTEX_UNLOCK(&cache_map->mutex);
     return 0;
 }
 
@@ -99,11 +89,8 @@ void free_elem(void *elem) {
 }
 
 int cache_map_destroy(struct cache_map *cache_map) {
-    printf("Destroying cache containing %d elements\n", cache_map->arrayset.data_size);
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    int res = pthread_mutex_destroy(&cache_map->mutex);
-    if (res < 0) return res;
-#endif
+    LOG_DEBUG("Destroying cache containing %d elements", cache_map->arrayset.data_size);
+    MUTEX_DESTROY(&cache_map->mutex);
     arrayset_free(&cache_map->arrayset, free_elem);
     //puts("Cache destroyed");
     return 0;
@@ -113,36 +100,37 @@ struct cache *cache_create(char *key) {
     struct cache *cache = (struct cache *) malloc(sizeof(struct cache));
 //    puts("Creating cache");
     if (cache == NULL) {
-        perror("Couldn't allocate cache structure:");
+        LOG_ERROR("Couldn't allocate cache structure: %s", strerror(errno));
         return NULL;
     }
-    strncpy(cache->key, key, CACHE_KEY_MAX_SIZE);
+    strncpy(cache->key, key, CACHE_KEY_MAX_SIZE - 1);
+    cache->key[CACHE_KEY_MAX_SIZE - 1] = '\0';
 //    printf("cache: %.*s created\n", CACHE_KEY_MAX_SIZE, cache->key);
-#if defined(MULTITHREAD) || defined(THREADPOOL)
 //    int res = cond_rwlock_init(&cache->cond_rwlock);
 //    if (res < 0) {
 //        free(cache);
 //        return NULL;
 //    }
-    if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+    if (MUTEX_INIT(&cache->mutex) != 0) {
         free(cache);
         return NULL;
     }
-#endif
-#ifdef MULTITHREAD
-    if (pthread_mutex_init(&cache->cacheMutex, NULL) != 0 || pthread_cond_init(&cache->cacheCond, NULL) != 0) {
-        pthread_mutex_destroy(&cache->mutex);
-        pthread_mutex_destroy(&cache->cacheMutex);
-        pthread_cond_destroy(&cache->cacheCond);
+    if (COND_INIT(&cache->cond) != 0) {
+        MUTEX_DESTROY(&cache->mutex);
         free(cache);
         return NULL;
     }
-#endif
+    cache->waiting = 0;
+    cache->map_index = -1;
     update_time_func(&cache->last_used_time);
     cache->users_cnt = 1;
     cache->first = NULL;
     cache->last = NULL;
+    cache->replaced_first = NULL;
+    cache->subscribers.next = &cache->subscribers;
+    cache->subscribers.prev = &cache->subscribers;
     cache->finished = 0;
+    cache->content_length = -1;
     return cache;
 }
 
@@ -150,83 +138,173 @@ void cache_release(struct cache **_cache) {
     struct cache *cache = *_cache;
     *_cache = NULL;
     if (cache == NULL) return;
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_lock(&cache->mutex);
-#endif
+    MUTEX_LOCK(&cache->mutex);
     cache->users_cnt--;
 //    printf("%s:\n cache users: %d\n", cache->key, cache->users_cnt);
     update_time_func(&cache->last_used_time);
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_unlock(&cache->mutex);
-#endif
+    MUTEX_UNLOCK(&cache->mutex);
     if (cache->users_cnt == 0) {
         struct cache_node *node = cache->first;
-        printf("Deleting cache %s, as all users released it\n", cache->key);
+        LOG_DEBUG("Deleting cache %s, as all users released it", cache->key);
         while (node != NULL) {
             struct cache_node *buff = node;
             node = node->next;
             free(buff);
         }
-        free(cache);
-#if defined(MULTITHREAD) || defined(THREADPOOL)
+        free(cache->replaced_first);
 //        cond_rwlock_destroy(&cache->cond_rwlock);
-        pthread_mutex_destroy(&cache->mutex);
-#endif
-#ifdef MULTITHREAD
-        pthread_mutex_destroy(&cache->cacheMutex);
-        pthread_cond_destroy(&cache->cacheCond);
-#endif
+        MUTEX_DESTROY(&cache->mutex);
+        COND_DESTROY(&cache->cond);
+        free(cache);
     }
 }
 
 void cache_add_user(struct cache *cache) {
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_lock(&cache->mutex);
-#endif
+    MUTEX_LOCK(&cache->mutex);
     cache->users_cnt++;
 //    printf("%s:\n cache users: %d\n", cache->key, cache->users_cnt);
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-    pthread_mutex_unlock(&cache->mutex);
-#endif
+    MUTEX_UNLOCK(&cache->mutex);
+}
+
+/*
+ * Called after the bytes are added, the lock orders them before the check of a subscriber,
+ * so a reader either sees the bytes or is subscribed by the time it's looked for.
+ * */
+void cache_notify_subscribers(struct cache *cache) {
+    struct cache_subscriber *subscriber;
+    MUTEX_LOCK(&cache->mutex);
+    while (cache->subscribers.next != &cache->subscribers) {
+        subscriber = cache->subscribers.next;
+        subscriber->next->prev = subscriber->prev;
+        subscriber->prev->next = subscriber->next;
+        subscriber->next = NULL;
+        subscriber->prev = NULL;
+        subscriber->notify(subscriber);
+    }
+    if (cache->waiting > 0) COND_BROADCAST(&cache->cond);
+    MUTEX_UNLOCK(&cache->mutex);
 }
 
 void cache_finish(struct cache *cache) {
-#ifdef MULTITHREAD
-    pthread_mutex_lock(&cache->cacheMutex);
-#endif
-    cache->finished = 1;
-#ifdef MULTITHREAD
-    pthread_cond_broadcast(&cache->cacheCond);
-    pthread_mutex_unlock(&cache->cacheMutex);
-#endif
+    //release pairs with the acquire of readers, so a reader that sees the cache finished sees its content length too
+    __atomic_store_n(&cache->finished, 1, __ATOMIC_RELEASE);
 //    cond_rwlock_drop(&cache->cond_rwlock);
+    cache_notify_subscribers(cache);
 }
 
-int cache_add_bytes(struct cache *cache, char *bytes, int len) {
+int cache_is_finished(struct cache *cache) {
+    return __atomic_load_n(&cache->finished, __ATOMIC_ACQUIRE);
+}
+
+void cache_set_content_length(struct cache *cache, ssize_t content_length) {
+    __atomic_store_n(&cache->content_length, content_length, __ATOMIC_RELEASE);
+}
+
+ssize_t cache_get_content_length(struct cache *cache) {
+    return __atomic_load_n(&cache->content_length, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Readers walk the nodes without the lock, so the links and lengths of nodes are published
+ * with release stores after the node is filled, and read with acquire loads.
+ * */
+static struct cache_node *load_first(struct cache *cache) {
+    return __atomic_load_n(&cache->first, __ATOMIC_ACQUIRE);
+}
+
+static struct cache_node *load_next(struct cache_node *node) {
+    return __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+}
+
+static int load_data_len(struct cache_node *node) {
+    return __atomic_load_n(&node->data_len, __ATOMIC_ACQUIRE);
+}
+
+void cache_append_node(struct cache *cache, struct cache_node *node) {
+//    cond_rwlock_wrlock(&cache->cond_rwlock);
+    if (cache->first == NULL) {
+        cache->last = node;
+        __atomic_store_n(&cache->first, node, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&cache->last->next, node, __ATOMIC_RELEASE);
+        cache->last = node;
+    }
+//    cond_rwlock_wrunlock(&cache->cond_rwlock);
+    //reserved node is empty, readers wait for its bytes
+    if (node->data_len > 0) cache_notify_subscribers(cache);
+}
+
+int cache_reserve(struct cache *cache, int len) {
     struct cache_node *node = (struct cache_node *) malloc(sizeof(struct cache_node) + sizeof(char) * len);
     if (node == NULL) {
-        fprintf(stderr, "Couldn't add bytes to cache: %s\n", strerror(errno));
+        LOG_ERROR("Couldn't reserve %d bytes in cache: %s", len, strerror(errno));
+        return -1;
+    }
+    node->data_len = 0;
+    node->size = len;
+    node->next = NULL;
+    cache_append_node(cache, node);
+    return 0;
+}
+
+int cache_get_free_space(struct cache *cache, char **buffer) {
+    if (cache->last == NULL) return 0;
+    *buffer = cache->last->bytes + cache->last->data_len;
+    return cache->last->size - cache->last->data_len;
+}
+
+void cache_commit_bytes(struct cache *cache, int len) {
+    __atomic_store_n(&cache->last->data_len, cache->last->data_len + len, __ATOMIC_RELEASE);
+    cache_notify_subscribers(cache);
+}
+
+int cache_add_bytes(struct cache *cache, char *bytes, int len) {
+    struct cache_node *node;
+    char *free_space;
+    int free_len = cache_get_free_space(cache, &free_space);
+    if (free_len > 0) {
+        free_len = (free_len < len ? free_len : len);
+        memcpy(free_space, bytes, sizeof(char) * free_len);
+        cache_commit_bytes(cache, free_len);
+        bytes += free_len;
+        len -= free_len;
+    }
+    if (len == 0) return 0;
+    node = (struct cache_node *) malloc(sizeof(struct cache_node) + sizeof(char) * len);
+    if (node == NULL) {
+        LOG_ERROR("Couldn't add bytes to cache: %s", strerror(errno));
         return -1;
     }
     memcpy(node->bytes, bytes, sizeof(char) * len);
     node->data_len = len;
+    node->size = len;
     node->next = NULL;
-#if defined(MULTITHREAD)
-//    cond_rwlock_wrlock(&cache->cond_rwlock);
-    pthread_mutex_lock(&cache->cacheMutex);
-#endif
-    if (cache->first == NULL) {
-        cache->last = node;
-        cache->first = node;
-    } else {
-        cache->last->next = node;
+    cache_append_node(cache, node);
+    return 0;
+}
+
+int cache_replace_first(struct cache *cache, char *bytes, int len) {
+    struct cache_node *node = (struct cache_node *) malloc(sizeof(struct cache_node) + sizeof(char) * len);
+    if (node == NULL) {
+        LOG_ERROR("Couldn't replace first node of cache: %s", strerror(errno));
+        return -1;
+    }
+    if (cache->first == NULL || cache->replaced_first != NULL) {
+        free(node);
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(node->bytes, bytes, sizeof(char) * len);
+    node->data_len = len;
+    node->size = len;
+    MUTEX_LOCK(&cache->mutex);
+    node->next = cache->first->next;
+    if (cache->last == cache->first) {
         cache->last = node;
     }
-#if defined(MULTITHREAD)
-//    cond_rwlock_wrunlock(&cache->cond_rwlock);
-    pthread_cond_broadcast(&cache->cacheCond);
-    pthread_mutex_unlock(&cache->cacheMutex);
-#endif
+    cache->replaced_first = cache->first;
+    __atomic_store_n(&cache->first, node, __ATOMIC_RELEASE);
+    MUTEX_UNLOCK(&cache->mutex);
     return 0;
 }
 
@@ -234,24 +312,30 @@ void cache_init_reader(struct cache *cache, struct cache_reader *reader) {
     reader->cache = cache;
     reader->offset = 0;
     if (cache == NULL) {
-        puts("Initializing reader on NULL cache");
+        LOG_DEBUG("Initializing reader on NULL cache");
         return;
     }
 //#if defined(MULTITHREAD) || defined(THREADPOOL)
 //    cond_rwlock_rdlock(&cache->cond_rwlock);
 //#endif
-    reader->cache_node = cache->first;
+    reader->cache_node = load_first(cache);
+    reader->first_node = reader->cache_node;
 //#if defined(MULTITHREAD) || defined(THREADPOOL)
 //    cond_rwlock_rdunlock(&cache->cond_rwlock);
 //#endif
     cache_add_user(cache);
 }
 
+//reserved nodes are appended empty, so the reader moves to the next node only when it has some bytes
 int cache_reader_has_data_available(struct cache_reader *reader) {
-    return (reader->cache_node == NULL && reader->cache->first != NULL) ||
-           (reader->cache_node != NULL &&
-            (reader->cache_node->next != NULL ||
-             reader->offset < reader->cache_node->data_len));
+    struct cache_node *next;
+    if (reader->cache_node != NULL && reader->offset < load_data_len(reader->cache_node)) return 1;
+    next = (reader->cache_node == NULL ? load_first(reader->cache) : load_next(reader->cache_node));
+    return next != NULL && load_data_len(next) > 0;
+}
+
+int cache_reader_started_from_first(struct cache_reader *reader) {
+    return reader->first_node == load_first(reader->cache);
 }
 
 //int predicate(void *arg) {
@@ -260,43 +344,46 @@ int cache_reader_has_data_available(struct cache_reader *reader) {
 
 int move_to_next_node(struct cache_reader *reader, char **buffer) {
     if (reader->cache_node == NULL) {
-        reader->cache_node = reader->cache->first;
+        reader->cache_node = load_first(reader->cache);
+        reader->first_node = reader->cache_node;
     } else {
-        reader->cache_node = reader->cache_node->next;
+        reader->cache_node = load_next(reader->cache_node);
     }
     reader->offset = 0;
     *buffer = reader->cache_node->bytes;
-    return reader->cache_node->data_len;
+    return load_data_len(reader->cache_node);
 }
 
-int cache_reader_get_bytes(struct cache_reader *reader, char **buffer) {
-    struct cache *cache = reader->cache;
-    int res;
+int cache_reader_try_get_bytes(struct cache_reader *reader, char **buffer) {
+    int len = (reader->cache_node != NULL ? load_data_len(reader->cache_node) : 0);
+    if (cache_is_finished(reader->cache) && !cache_reader_has_data_available(reader)) return ECACHE_FINISHED;
 
-    if (reader->cache->finished && !cache_reader_has_data_available(reader)) return ECACHE_FINISHED;
-
-    if (reader->cache_node != NULL && reader->offset < reader->cache_node->data_len) {
+    if (reader->offset < len) {
         *buffer = reader->cache_node->bytes + reader->offset;
-        return reader->cache_node->data_len - reader->offset;
+        return len - reader->offset;
     }
 
     if (cache_reader_has_data_available(reader)) {
         return move_to_next_node(reader, buffer);
     }
-#if defined(MULTITHREAD)
-    pthread_mutex_lock(&cache->cacheMutex);
-    while (!cache_reader_has_data_available(reader) && !cache->finished) {
-        pthread_cond_wait(&cache->cacheCond, &cache->cacheMutex);
-    }
-    pthread_mutex_unlock(&cache->cacheMutex);
-    if (cache_reader_has_data_available(reader)) {
-        return move_to_next_node(reader, buffer);
-    } else if (cache->finished) {
-        return ECACHE_FINISHED;
-    }
-#endif
     return ECACHE_WOULDBLOCK;
 }
+
+int cache_reader_get_bytes(struct cache_reader *reader, char **buffer) {
+    return cache_reader_try_get_bytes(reader, buffer);
+}
+
+//new bytes and finishing are followed by cache_notify_subscribers(), which wakes the waiting readers
+void cache_reader_wait(struct cache_reader *reader) {
+    struct cache *cache = reader->cache;
+    MUTEX_LOCK(&cache->mutex);
+    while (!cache_reader_has_data_available(reader) && !cache_is_finished(cache)) {
+        cache->waiting++;
+        COND_WAIT(&cache->cond, &cache->mutex);
+        cache->waiting--;
+    }
+    MUTEX_UNLOCK(&cache->mutex);
+}
 //    if (block_flag) {
 //        cond_rwlock_wait_and_rdlock(&cache->cond_rwlock, predicate, reader);
 //    } else {
@@ -322,8 +409,48 @@ int cache_reader_get_bytes(struct cache_reader *reader, char **buffer) {
 
 int cache_reader_skip_bytes(struct cache_reader *reader, int bytes_num) {
     reader->offset += bytes_num;
-    assert(reader->offset <= reader->cache_node->data_len);
-    if (reader->offset != reader->cache_node->data_len) return 0;
+    assert(reader->offset <= load_data_len(reader->cache_node));
+    if (reader->offset != load_data_len(reader->cache_node)) return 0;
+    return 1;
+}
+
+void cache_subscriber_init(struct cache_subscriber *subscriber, void (*notify)(struct cache_subscriber *)) {
+    subscriber->next = NULL;
+    subscriber->prev = NULL;
+    subscriber->notify = notify;
+}
+
+int cache_subscribe(struct cache_reader *reader, struct cache_subscriber *subscriber,
+                    void (*subscribed)(void *arg), void *arg) {
+    struct cache *cache = reader->cache;
+    int res = 0;
+    //bytes are never taken back and a finished cache stays finished, so only waiting needs the lock
+    if (cache_is_finished(cache) || cache_reader_has_data_available(reader)) return 0;
+    MUTEX_LOCK(&cache->mutex);
+    if (!cache_is_finished(cache) && !cache_reader_has_data_available(reader)) {
+        if (subscriber->next == NULL) {
+            subscriber->prev = cache->subscribers.prev;
+            subscriber->next = &cache->subscribers;
+            cache->subscribers.prev->next = subscriber;
+            cache->subscribers.prev = subscriber;
+        }
+        subscribed(arg);
+        res = 1;
+    }
+    MUTEX_UNLOCK(&cache->mutex);
+    return res;
+}
+
+void cache_unsubscribe(struct cache *cache, struct cache_subscriber *subscriber) {
+    if (cache == NULL) return;
+    MUTEX_LOCK(&cache->mutex);
+    if (subscriber->next != NULL) {
+        subscriber->next->prev = subscriber->prev;
+        subscriber->prev->next = subscriber->next;
+        subscriber->next = NULL;
+        subscriber->prev = NULL;
+    }
+    MUTEX_UNLOCK(&cache->mutex);
 }
 
 void cache_reader_release_cache(struct cache_reader *reader) {
@@ -3,6 +3,7 @@
 
 #include "consts.h"
 #include "arrayset.h"
+#include "lock.h"
 
 //#if defined(MULTITHREAD) || defined(THREADPOOL)
 //#include "condrwlock.h"
@@ -17,23 +18,35 @@
 struct cache_node {
     struct cache_node *next;
     int data_len;
+    int size;                                   //number of bytes allocated for the node, greater than data_len if reserved
     char bytes[];
 };
 
+/*
+ * Reader that has read every byte of an unfinished cache subscribes to it instead of polling the cache.
+ * Subscriber is notified once, when the cache gets new bytes or is finished, and is unsubscribed at that moment.
+ * notify is called with the cache locked, so it must not call the functions of the cache.
+ * */
+struct cache_subscriber {
+    struct cache_subscriber *next;              //NULL if the subscriber is not subscribed
+    struct cache_subscriber *prev;
+    void (*notify)(struct cache_subscriber *subscriber);
+};
+
 struct cache {
-#if defined(MULTITHREAD) || defined(THREADPOOL)
 //    struct cond_rwlock cond_rwlock;             //this rwlock used to synchronize reading from cache and writing to cache
     pthread_mutex_t mutex;                      //this mutex used to synchronize access to the users_cnt variable
-#endif
-#ifdef MULTITHREAD
-    pthread_cond_t cacheCond;
-    pthread_mutex_t cacheMutex;
-#endif
+    pthread_cond_t cond;                        //broadcast with the subscribers notified if someone waits in cache_reader_wait()
+    int waiting;                                //number of readers waiting in cache_reader_wait(), guarded by mutex
     struct timeval last_used_time;              //this time is updated when someone stops using cache
     int finished;                               //if this flag is not zero, than no one supposed to write data to this cache anymore
+    ssize_t content_length;                     //length of the response body, -1 if the body is delimited by connection close
     int users_cnt;                              //number of threads, using this cache. When every thread calls cache_release(),
     //this variable becomes 0 and than the cache is deleted
     struct cache_node *first, *last;            //first and last elements of the queue
+    struct cache_node *replaced_first;          //first node replaced by cache_replace_first(), kept for readers that started from it
+    struct cache_subscriber subscribers;        //head of the circular list of subscribers, guarded by mutex
+    int map_index;                              //slot in the arrayset of the cache map, -1 if the cache isn't there
     char key[CACHE_KEY_MAX_SIZE];               //key associated with that cache, usually it is host + path parsed from http request
 };
 
@@ -41,20 +54,17 @@ struct cache;
 struct cache_reader {
     struct cache *cache;
     struct cache_node *cache_node;
+    struct cache_node *first_node;              //node the reader started from, differs from cache->first if it was replaced
     int offset;
 };
 
-#if defined(MULTITHREAD) || defined(THREADPOOL)
-#define CACHE_MAP_INITIALIZER { ARRAY_SET_INITIALIZER, PTHREAD_MUTEX_INITIALIZER }
-#else
-#define CACHE_MAP_INITIALIZER { ARRAY_SET_INITIALIZER }
-#endif
+#define CACHE_MAP_INITIALIZER { ARRAY_SET_INDEXED_INITIALIZER(struct cache, map_index), PTHREAD_MUTEX_INITIALIZER, \
+                               DEFAULT_CACHE_MAP_SIZE }
 
 struct cache_map {
     struct arrayset arrayset;
-#if defined(MULTITHREAD) || defined(THREADPOOL)
     pthread_mutex_t mutex;
-#endif
+    int max_size;                               //the least recently used cache is removed to add one more
 };
 
 int cache_map_init(struct cache_map *cache_map);
@@ -74,17 +84,54 @@ void cache_add_user(struct cache *cache);
 
 void cache_finish(struct cache *cache);
 
-//int cache_is_finished(struct cache *cache);
+int cache_is_finished(struct cache *cache);
+
+//content length is set by the server thread while clients read it, it's published with release and read with acquire
+void cache_set_content_length(struct cache *cache, ssize_t content_length);
+
+ssize_t cache_get_content_length(struct cache *cache);
 
 int cache_add_bytes(struct cache *cache, char *bytes, int len);
 
+//appends a node of len bytes, which is filled by next cache_add_bytes() or cache_commit_bytes() calls
+int cache_reserve(struct cache *cache, int len);
+
+//returns the number of reserved bytes that are not filled yet, buffer is set to the first of them
+int cache_get_free_space(struct cache *cache, char **buffer);
+
+//makes len bytes written to the space returned by cache_get_free_space() available to readers
+void cache_commit_bytes(struct cache *cache, int len);
+
+//replaces the first node of the cache, readers that already started from the old node continue reading after it
+int cache_replace_first(struct cache *cache, char *bytes, int len);
+
 void cache_init_reader(struct cache *cache, struct cache_reader *reader);
 
-//if block_flag is not 0, cache is not finished but doesn't have new data at the moment, this function will block until there is new data available
+//returns 0 if the node the reader started from was replaced by cache_replace_first() after that
+int cache_reader_started_from_first(struct cache_reader *reader);
+
+//returns ECACHE_WOULDBLOCK if the cache is not finished but doesn't have new data at the moment
 int cache_reader_get_bytes(struct cache_reader *reader, char **buffer);
 
+//blocks until the cache has new data for the reader or is finished, used by the blocking multithread engine
+void cache_reader_wait(struct cache_reader *reader);
+
+//returns 1 if the node of the reader is read to its end
 int cache_reader_skip_bytes(struct cache_reader *reader, int bytes_num);
 
+void cache_subscriber_init(struct cache_subscriber *subscriber, void (*notify)(struct cache_subscriber *));
+
+/*
+ * Subscribes to the cache of the reader if the reader has nothing to read and the cache is not finished.
+ * If it does, subscribed(arg) is called before the cache is unlocked, so the caller gets ready
+ * to be notified before notify can be called. Returns 1 if subscribed.
+ * */
+int cache_subscribe(struct cache_reader *reader, struct cache_subscriber *subscriber,
+                    void (*subscribed)(void *arg), void *arg);
+
+//does nothing if the subscriber is not subscribed
+void cache_unsubscribe(struct cache *cache, struct cache_subscriber *subscriber);
+
 void cache_reader_release_cache(struct cache_reader *reader);
 
 #endif //PROXY_CACHE_H
@@ -1,15 +1,7 @@
 #ifndef PROXY_CONSTS_H
 #define PROXY_CONSTS_H
 
-#include "proxytype.h"
-
-#if defined(MULTITHREAD) || defined (THREADPOOL)
 #include <pthread.h>
-#include <semaphore.h>
-#endif
-#ifdef THREADPOOL
-#include "semaphore.h"
-#endif
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -22,6 +14,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <strings.h>
 #include <errno.h>
 #include <netdb.h>
 #include <sys/poll.h>
@@ -32,20 +25,17 @@
 #define CLIENT_SEND_FLAGS MSG_NOSIGNAL
 #define SERVER_SEND_FLAGS MSG_NOSIGNAL
 
-#ifdef MULTITHREAD
-#define SERVER_RECV_FLAGS 0
+#define SERVER_RECV_FLAGS 0                 //sockets of the event loop engines are non-blocking themselves
 #define CLIENT_RECV_FLAGS 0
-#else
-#define SERVER_RECV_FLAGS MSG_DONTWAIT
-#define CLIENT_RECV_FLAGS MSG_DONTWAIT
-#endif
+#define SERVER_SOCKET_FLAGS (SOCK_NONBLOCK | SOCK_CLOEXEC)    //connect() doesn't block the event loop
+#define BLOCKING_SERVER_SOCKET_FLAGS SOCK_CLOEXEC             //used by multithread engine
 
-#ifdef SINGLETHREAD
-#define THREAD_NUM 1
-#endif
-#ifdef THREADPOOL
-#define THREAD_NUM 8
-#endif
+#define DEFAULT_THREAD_NUM 8                //worker threads of threadpool engine
+#define DEFAULT_MAX_THREAD_NUM 64           //threadpool engine grows up to it while workers are blocked
+#define DEFAULT_REACTOR_NUM 0               //0 means a reactor per online CPU
+#define CONNECT_THREAD_NUM 1                //threads resolving and connecting servers for the multireactor
+#define CONNECT_MAX_THREAD_NUM 16           //connect pool grows up to it while its threads wait for DNS
+#define CACHE_LINE_SIZE 64
 
 #define POLL_TIMEOUT 1000
 #define HTTP_MSG_LEN_MAX 256
@@ -56,10 +46,24 @@
 #define SERVER_RECV_BUFFER_SIZE 2048
 #define NUM_HEADERS 100
 #define BACKLOG 510
+#define ACCEPT_BUDGET 64                    //max number of connections accepted per ready event of listening socket
+#define MAX_PIPELINED_REQUESTS 16           //responses queued behind the one being sent, the client isn't read beyond it
+#define IO_BUDGET (256 * 1024)              //bytes handled per ready event of a connection before it gives way to others
 #define HOST_HEADER_NAME "Host"
+#define CONTENT_LENGTH_HEADER_NAME "Content-Length"
+#define TRANSFER_ENCODING_HEADER_NAME "Transfer-Encoding"
+#define CONNECTION_HEADER_NAME "Connection"
+#define PROXY_CONNECTION_HEADER_NAME "Proxy-Connection"
+#define KEEP_ALIVE_HEADER_NAME "Keep-Alive"
+#define CLIENT_HEADER_TIMEOUT 10            //seconds a client may take to send the header of a request
+#define CLIENT_IDLE_TIMEOUT 30              //seconds a keep-alive client may stay without sending a request
+#define SERVER_FIRST_BYTE_TIMEOUT 30        //seconds a server may take to start the response
+#define SERVER_RECV_TIMEOUT 30              //seconds a server may stay silent in the middle of the response
 #define DEBUG
 
-#define CACHE_MAP_SIZE 2048
+#define DEFAULT_CACHE_MAP_SIZE 2048         //max number of cached responses
 #define CACHE_KEY_MAX_SIZE 2048
+#define CACHE_SEGMENT_MAX_SIZE (16 * 1024 * 1024)  //max size of one node reserved for a body with known length
+#define CACHE_SEGMENT_MIN_SIZE (64 * 1024)  //size of the first node reserved for a body, doubled for every next one
 
 #endif //PROXY_CONSTS_H
@@ -0,0 +1,44 @@
+/*
+ * Engine is the way the proxy handles its connections, it is chosen at startup:
+ * singlethread - one reactor, its handlers are run one after another by the main thread;
+ * threadpool - one reactor, its handlers are run concurrently by a pool of worker threads;
+ * multireactor - a reactor per thread, each with its own SO_REUSEPORT listening socket;
+ * multithread - a thread per connection with blocking sockets.
+ * Everything the engines share is locked through the lock operations of the running engine.
+ * */
+#ifndef PROXY_ENGINE_H
+#define PROXY_ENGINE_H
+
+#include "consts.h"
+#include "lock.h"
+#include "cache.h"
+
+struct proxy_config {
+    struct sockaddr_in listen_addr;
+    int thread_num;                         //workers of threadpool or reactors of multireactor, 0 for the default
+    int max_thread_num;                     //threadpool grows up to it, 0 for the default
+    int cache_map_size;                     //max number of cached responses
+    int backend;                            //event loop backend of the reactors
+    int pin_threads;                        //pins pool workers or reactors to CPUs, node by node
+};
+
+struct engine {
+    char *name;
+    const struct lock_ops *lock_ops;        //threaded engines lock with pthread, singlethread doesn't lock at all
+    int (*run)(struct proxy_config *config); //returns when running is reset, -1 if the engine couldn't start
+};
+
+extern struct engine singlethread_engine;
+extern struct engine threadpool_engine;
+extern struct engine multireactor_engine;
+extern struct engine multithread_engine;
+
+extern short running;
+extern struct cache_map map;
+
+//type_flags are added to SOCK_STREAM, reuse_port lets several sockets listen on the same address
+int init_listening_socket(struct sockaddr_in *my_addr, int type_flags, int reuse_port);
+
+int init_sigint_handler();
+
+#endif //PROXY_ENGINE_H
@@ -0,0 +1,406 @@
+#include "eventloop.h"
+#include "log.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+uint32_t to_epoll_events(int events) {
+    return (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+int from_epoll_events(uint32_t events) {
+    return (events & EPOLLIN ? POLLIN : 0) | (events & EPOLLOUT ? POLLOUT : 0) |
+           (events & EPOLLHUP ? POLLHUP : 0) | (events & EPOLLERR ? POLLERR : 0);
+}
+
+int epoll_update(struct event_loop *loop, struct event_source *source, int op) {
+    struct epoll_event event;
+    event.events = to_epoll_events(source->events) | (loop->oneshot ? EPOLLONESHOT : 0);
+    event.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, op, source->fd, &event) < 0) {
+        LOG_ERROR("epoll_ctl(%s) failed: %s", (op == EPOLL_CTL_ADD ? "EPOLL_CTL_ADD" : "EPOLL_CTL_MOD"),
+                  strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t uring_user_data(struct event_loop *loop, struct event_source *source) {
+    return ((uint64_t) loop->slots[source->slot].generation << 32) | (uint32_t) source->slot;
+}
+
+//poll masks of io_uring are POLL* values, POLLERR and POLLHUP are always reported
+int uring_arm(struct event_loop *loop, struct event_source *source) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = source->fd;
+    sqe->poll32_events = source->events;
+    sqe->user_data = uring_user_data(loop, source);
+    uring_queue_sqe(&loop->uring);
+    source->armed = 1;
+    return 0;
+}
+
+//completion of the removed poll, if it comes, has old generation and is ignored
+int uring_disarm(struct event_loop *loop, struct event_source *source) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->uring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(loop, source);
+    sqe->user_data = URING_IGNORED_USER_DATA;
+    uring_queue_sqe(&loop->uring);
+    loop->slots[source->slot].generation++;
+    source->armed = 0;
+    return 0;
+}
+
+int uring_allocate_slot(struct event_loop *loop, struct event_source *source) {
+    int i;
+    if (loop->first_free_slot < 0) {
+        int slot_num = (loop->slot_num == 0 ? URING_INITIAL_SLOT_NUM : loop->slot_num * 2);
+        struct uring_slot *slots = (struct uring_slot *) realloc(loop->slots, slot_num * sizeof(struct uring_slot));
+        if (slots == NULL) return -1;
+        for (i = loop->slot_num; i < slot_num; i++) {
+            slots[i].source = NULL;
+            slots[i].generation = 0;
+            slots[i].next_free = (i + 1 < slot_num ? i + 1 : -1);
+        }
+        loop->first_free_slot = loop->slot_num;
+        loop->slots = slots;
+        loop->slot_num = slot_num;
+    }
+    source->slot = loop->first_free_slot;
+    loop->first_free_slot = loop->slots[source->slot].next_free;
+    loop->slots[source->slot].source = source;
+    return 0;
+}
+
+void uring_free_slot(struct event_loop *loop, struct event_source *source) {
+    loop->slots[source->slot].source = NULL;
+    loop->slots[source->slot].generation++;
+    loop->slots[source->slot].next_free = loop->first_free_slot;
+    loop->first_free_slot = source->slot;
+}
+
+//wakes up the thread blocked in poll(), so that the re-armed pollfd is polled at once
+void poll_wakeup(struct event_loop *loop) {
+    uint64_t value = 1;
+    if (__atomic_exchange_n(&loop->wakeup_pending, 1, __ATOMIC_ACQ_REL)) return;
+    if (write(loop->wakeup_source.fd, &value, sizeof(value)) < 0) {
+        LOG_WARN("Couldn't wake up the event loop: %s", strerror(errno));
+    }
+}
+
+void poll_wakeup_received(struct event_loop *loop) {
+    uint64_t value;
+    __atomic_store_n(&loop->wakeup_pending, 0, __ATOMIC_RELEASE);
+    while (read(loop->wakeup_source.fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+int uring_loop_init(struct event_loop *loop) {
+    if (uring_init(&loop->uring, URING_ENTRIES) < 0) return -1;
+    loop->slots = NULL;
+    loop->slot_num = 0;
+    loop->first_free_slot = -1;
+    return 0;
+}
+
+int event_loop_init(struct event_loop *loop, int backend, int oneshot) {
+    int fd;
+    loop->backend = backend;
+    loop->oneshot = oneshot;
+    loop->epoll_fd = -1;
+    loop->scan_start = 0;
+    loop->wakeup_source.fd = -1;
+    loop->wakeup_pending = 0;
+    loop->rearm_num = 0;
+    MUTEX_INIT(&loop->mutex);
+    if (backend == EVENT_LOOP_IO_URING) {
+        if (uring_loop_init(loop) == 0) return 0;
+        LOG_WARN("io_uring is not available: %s, falling back to epoll", strerror(errno));
+        loop->backend = backend = EVENT_LOOP_EPOLL;
+    }
+    if (backend == EVENT_LOOP_EPOLL) {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            LOG_ERROR("epoll_create1() failed: %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    if (pollfdset_init(&loop->pollfdset) < 0) return -1;
+    if (!oneshot) return 0;
+    //epoll and io_uring see re-armed sources while they wait, poll() has to be interrupted
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("eventfd() failed: %s", strerror(errno));
+        pollfdset_destroy(&loop->pollfdset);
+        return -1;
+    }
+    event_source_init(&loop->wakeup_source, fd, POLLIN, NULL, NULL);
+    if (event_loop_add(loop, &loop->wakeup_source) < 0) {
+        close(fd);
+        pollfdset_destroy(&loop->pollfdset);
+        return -1;
+    }
+    return 0;
+}
+
+void event_source_init(struct event_source *source, int fd, int events, void (*handler)(void *), void *arg) {
+    source->fd = fd;
+    source->events = events;
+    source->revents = 0;
+    source->handler = handler;
+    source->arg = arg;
+    source->slot = -1;
+    source->armed = 0;
+}
+
+int event_loop_add(struct event_loop *loop, struct event_source *source) {
+    int res = 0;
+    source->armed = 1;
+    if (loop->backend == EVENT_LOOP_EPOLL) {
+        return epoll_update(loop, source, EPOLL_CTL_ADD);
+    }
+    MUTEX_LOCK(&loop->mutex);
+    if (loop->backend == EVENT_LOOP_IO_URING) {
+        res = uring_allocate_slot(loop, source);
+        if (res == 0 && (res = uring_arm(loop, source)) < 0) {
+            uring_free_slot(loop, source);
+        } else if (res == 0 && loop->oneshot) {
+            res = uring_submit(&loop->uring);
+        }
+    } else {
+        source->slot = allocate_pollfd(&loop->pollfdset, source->fd, source->events, source);
+        if (source->slot < 0) {
+            res = -1;
+        } else if (loop->oneshot && source != &loop->wakeup_source) {
+            poll_wakeup(loop);
+        }
+    }
+    MUTEX_UNLOCK(&loop->mutex);
+    return res;
+}
+
+//source that is not armed gets new events when it is re-armed, except for level triggered epoll and poll
+int event_loop_set_events(struct event_loop *loop, struct event_source *source, int events) {
+    int res = 0;
+    if (source->events == events) return 0;
+    source->events = events;
+    if (!source->armed && (loop->oneshot || loop->backend == EVENT_LOOP_IO_URING)) return 0;
+    if (loop->backend == EVENT_LOOP_EPOLL) {
+        return epoll_update(loop, source, EPOLL_CTL_MOD);
+    }
+    MUTEX_LOCK(&loop->mutex);
+    if (loop->backend == EVENT_LOOP_IO_URING) {
+        //armed poll is replaced by the one with new events
+        res = uring_disarm(loop, source);
+        if (res == 0) res = uring_arm(loop, source);
+        if (res == 0 && loop->oneshot) res = uring_submit(&loop->uring);
+    } else {
+        loop->pollfdset.fds[source->slot].events = events;
+    }
+    MUTEX_UNLOCK(&loop->mutex);
+    return res;
+}
+
+/*
+ * The source is armed under the lock, so the thread that waits can't return it before it's armed
+ * and the connection can't be disarmed and freed while it's being armed.
+ * io_uring poll is submitted at once, its completion wakes up the thread that waits. Adding a source and changing
+ * its events submit too: one-shot loop is waited by another thread, which submits only when its wait times out.
+ * */
+int event_loop_rearm(struct event_loop *loop, struct event_source *source) {
+    int res = 0;
+    if (!loop->oneshot) return 0;
+    MUTEX_LOCK(&loop->mutex);
+    if (loop->backend == EVENT_LOOP_IO_URING) {
+        res = uring_arm(loop, source);
+        if (res == 0) res = uring_submit(&loop->uring);
+    } else if (loop->backend == EVENT_LOOP_EPOLL) {
+        __atomic_store_n(&source->armed, 1, __ATOMIC_RELEASE);
+        res = epoll_update(loop, source, EPOLL_CTL_MOD);
+    } else {
+        loop->pollfdset.fds[source->slot].events = source->events;
+        loop->pollfdset.fds[source->slot].fd = source->fd;
+        __atomic_store_n(&source->armed, 1, __ATOMIC_RELEASE);
+        poll_wakeup(loop);
+    }
+    MUTEX_UNLOCK(&loop->mutex);
+    return res;
+}
+
+//epoll may still report disarmed source, epoll_wait_ready() skips it
+int event_loop_disarm(struct event_loop *loop, struct event_source *source) {
+    int armed;
+    MUTEX_LOCK(&loop->mutex);
+    armed = source->armed;
+    if (armed && !loop->oneshot) {
+        if (loop->rearm_num == 2 * EVENT_LOOP_MAX_EVENTS) {
+            armed = -1;
+        } else {
+            loop->rearm[loop->rearm_num++] = source;
+        }
+    }
+    if (armed == 1 && loop->backend == EVENT_LOOP_IO_URING) {
+        uring_disarm(loop, source);
+    } else if (armed == 1 && loop->backend == EVENT_LOOP_POLL && loop->oneshot) {
+        loop->pollfdset.fds[source->slot].fd = OCCUPIED_DESCRIPTOR;
+    }
+    if (armed == 1) __atomic_store_n(&source->armed, 0, __ATOMIC_RELEASE);
+    MUTEX_UNLOCK(&loop->mutex);
+    return armed;
+}
+
+int event_source_is_armed(struct event_source *source) {
+    return __atomic_load_n(&source->armed, __ATOMIC_ACQUIRE);
+}
+
+void event_loop_remove(struct event_loop *loop, struct event_source *source) {
+    int i;
+    if (loop->backend == EVENT_LOOP_EPOLL && epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) < 0) {
+        LOG_WARN("epoll_ctl(EPOLL_CTL_DEL) failed: %s", strerror(errno));
+    }
+    MUTEX_LOCK(&loop->mutex);
+    if (loop->backend == EVENT_LOOP_IO_URING) {
+        if (source->armed) uring_disarm(loop, source);
+        uring_free_slot(loop, source);
+    } else if (loop->backend == EVENT_LOOP_POLL && source->slot >= 0) {
+        free_pollfd(&loop->pollfdset, source->slot);
+        source->slot = -1;
+    }
+    for (i = 0; i < loop->rearm_num; i++) {
+        if (loop->rearm[i] == source) loop->rearm[i] = NULL;
+    }
+    MUTEX_UNLOCK(&loop->mutex);
+}
+
+int epoll_wait_ready(struct event_loop *loop, struct event_source **ready, int max_ready, int timeout) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int i, cnt = 0, res = epoll_wait(loop->epoll_fd, events, max_ready, timeout);
+    if (res < 0) return (errno == EINTR ? 0 : -1);
+    for (i = 0; i < res; i++) {
+        struct event_source *source = (struct event_source *) events[i].data.ptr;
+        if (!__atomic_exchange_n(&source->armed, 0, __ATOMIC_ACQ_REL)) continue;
+        source->revents = from_epoll_events(events[i].events);
+        ready[cnt++] = source;
+    }
+    return cnt;
+}
+
+/*
+ * Scanning starts where the previous one stopped, so that the first pollfds don't take all max_ready places.
+ * Pollfds of the sources returned by one-shot loop get negative fd, poll() skips them until they are re-armed.
+ * The pollfd array may grow while poll() runs, then revents are found in the array poll() was given.
+ * */
+int poll_wait_ready(struct event_loop *loop, struct event_source **ready, int max_ready, int timeout) {
+    struct pollfdset *set = &loop->pollfdset;
+    struct pollfd *fds;
+    int i, cnt = 0, checked, fd_num, res;
+    MUTEX_LOCK(&loop->mutex);
+    fds = set->fds;
+    fd_num = set->max_occupied_fd;
+    MUTEX_UNLOCK(&loop->mutex);
+    res = poll(fds, fd_num, timeout);
+    MUTEX_LOCK(&loop->mutex);
+    if (res < 0) {
+        res = (errno == EINTR ? 0 : -1);
+        fd_num = 0;
+    }
+    if (loop->scan_start >= fd_num) loop->scan_start = 0;
+    for (checked = 0, i = loop->scan_start; checked < fd_num && res > 0 && cnt < max_ready;
+         checked++, i = (i + 1 == fd_num ? 0 : i + 1)) {
+        struct event_source *source = (struct event_source *) set->owners[i];
+        if (fds[i].revents == 0) continue;
+        res--;
+        if (source == &loop->wakeup_source) {
+            poll_wakeup_received(loop);
+            continue;
+        }
+        //pollfd could be freed, disarmed or given to another source while poll() was running
+        if (source == NULL || !source->armed) continue;
+        source->revents = fds[i].revents & (source->events | POLLHUP | POLLERR);
+        if (source->revents == 0) continue;
+        __atomic_store_n(&source->armed, 0, __ATOMIC_RELEASE);
+        if (loop->oneshot) set->fds[i].fd = OCCUPIED_DESCRIPTOR;
+        ready[cnt++] = source;
+    }
+    loop->scan_start = i;
+    pollfdset_release_retired(set);
+    MUTEX_UNLOCK(&loop->mutex);
+    return (res < 0 ? -1 : cnt);
+}
+
+//completions that don't fit to ready stay in the completion queue for the next wait
+int uring_wait_ready(struct event_loop *loop, struct event_source **ready, int max_ready, int timeout) {
+    struct io_uring_cqe *cqe;
+    int cnt = 0;
+    if (uring_submit_and_wait(&loop->uring, timeout) < 0) return -1;
+    MUTEX_LOCK(&loop->mutex);
+    while (cnt < max_ready && (cqe = uring_peek_cqe(&loop->uring)) != NULL) {
+        uint64_t user_data = cqe->user_data;
+        uint32_t slot = (uint32_t) user_data;
+        int revents = cqe->res;
+        uring_cqe_seen(&loop->uring);
+        if (user_data == URING_IGNORED_USER_DATA || slot >= (uint32_t) loop->slot_num || loop->slots[slot].source == NULL ||
+            loop->slots[slot].generation != (uint32_t) (user_data >> 32)) {
+            continue;
+        }
+        ready[cnt] = loop->slots[slot].source;
+        __atomic_store_n(&ready[cnt]->armed, 0, __ATOMIC_RELEASE);
+        ready[cnt]->revents = (revents < 0 ? POLLERR : revents & (POLLIN | POLLOUT | POLLHUP | POLLERR));
+        cnt++;
+    }
+    MUTEX_UNLOCK(&loop->mutex);
+    return cnt;
+}
+
+/*
+ * Level triggered loop re-arms the sources returned by the previous wait here, their handlers are finished by now.
+ * io_uring polls of these sources are submitted by the same io_uring_enter() that waits.
+ * */
+int event_loop_wait(struct event_loop *loop, struct event_source **ready, int max_ready, int timeout) {
+    int i, cnt, res = 0;
+    if (max_ready > EVENT_LOOP_MAX_EVENTS) max_ready = EVENT_LOOP_MAX_EVENTS;
+    MUTEX_LOCK(&loop->mutex);
+    for (i = 0; i < loop->rearm_num && res == 0; i++) {
+        if (loop->rearm[i] == NULL) continue;
+        if (loop->backend == EVENT_LOOP_IO_URING) {
+            res = uring_arm(loop, loop->rearm[i]);
+        } else {
+            loop->rearm[i]->armed = 1;
+        }
+    }
+    loop->rearm_num = 0;
+    MUTEX_UNLOCK(&loop->mutex);
+    if (res < 0) return -1;
+    if (loop->backend == EVENT_LOOP_IO_URING) {
+        cnt = uring_wait_ready(loop, ready, max_ready, timeout);
+    } else if (loop->backend == EVENT_LOOP_EPOLL) {
+        cnt = epoll_wait_ready(loop, ready, max_ready, timeout);
+    } else {
+        cnt = poll_wait_ready(loop, ready, max_ready, timeout);
+    }
+    if (cnt > 0 && !loop->oneshot) {
+        memcpy(loop->rearm, ready, cnt * sizeof(struct event_source *));
+        loop->rearm_num = cnt;
+    }
+    return cnt;
+}
+
+void event_loop_destroy(struct event_loop *loop) {
+    if (loop->wakeup_source.fd >= 0) {
+        event_loop_remove(loop, &loop->wakeup_source);
+        close(loop->wakeup_source.fd);
+    }
+    if (loop->backend == EVENT_LOOP_IO_URING) {
+        uring_destroy(&loop->uring);
+        free(loop->slots);
+    } else if (loop->backend == EVENT_LOOP_EPOLL) {
+        close(loop->epoll_fd);
+    } else {
+        pollfdset_destroy(&loop->pollfdset);
+    }
+    MUTEX_DESTROY(&loop->mutex);
+}
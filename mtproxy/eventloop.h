@@ -0,0 +1,104 @@
+/*
+ * Event loop over the sockets of tpproxy.
+ * Each registered fd is an event_source that carries the handler to run when the fd is ready,
+ * so dispatch doesn't need to search for the connection owning the fd.
+ *
+ * Two backends are available:
+ * EVENT_LOOP_EPOLL - cost of a wait is proportional to the number of ready fds;
+ * EVENT_LOOP_POLL - poll() over the pollfdset, cost of a wait is proportional to the number of fds;
+ * EVENT_LOOP_IO_URING - one-shot IORING_OP_POLL_ADD per fd, changes of the interest sets and re-arming
+ * of the sources returned by the previous wait are submitted by the same io_uring_enter() that waits,
+ * so there is no syscall per change. Falls back to epoll if the kernel can't do it.
+ * Events are POLLIN/POLLOUT and revents are POLLIN/POLLOUT/POLLHUP/POLLERR.
+ *
+ * A source returned by a wait is not armed: it isn't returned again until it is re-armed.
+ * By default the loop is level triggered, the next wait re-arms the sources returned by the previous one,
+ * so their handlers must be finished before the next wait.
+ * One-shot loop lets the handlers run concurrently with the waits: a source stays not armed
+ * until its handler calls event_loop_rearm(), so it is never handled by two threads at once.
+ * */
+#ifndef PROXY_EVENT_LOOP_H
+#define PROXY_EVENT_LOOP_H
+
+#include "consts.h"
+#include "lock.h"
+#include "pollfdset.h"
+#include "uring.h"
+
+#define EVENT_LOOP_POLL 0
+#define EVENT_LOOP_EPOLL 1
+#define EVENT_LOOP_IO_URING 2
+
+#ifndef EVENT_LOOP_BACKEND
+#define EVENT_LOOP_BACKEND EVENT_LOOP_EPOLL
+#endif //EVENT_LOOP_BACKEND
+
+#define EVENT_LOOP_MAX_EVENTS 256           //max number of ready sources returned by one wait
+#define URING_ENTRIES 1024                  //size of io_uring submission queue
+#define URING_INITIAL_SLOT_NUM 64
+#define URING_IGNORED_USER_DATA UINT64_MAX  //user_data of the completions nobody waits for
+
+struct event_source {
+    int fd;
+    int events;
+    int revents;                            //set by event_loop_wait(), the handler should reset it
+    void (*handler)(void *arg);
+    void *arg;
+    int slot;                               //index of the pollfd or the io_uring slot of the source
+    int armed;                              //the source can be returned by a wait
+};
+
+//io_uring completions refer to sources by slot and generation, so completions of removed sources are ignored
+struct uring_slot {
+    struct event_source *source;
+    uint32_t generation;
+    int next_free;
+};
+
+struct event_loop {
+    int backend;
+    int oneshot;
+    int epoll_fd;
+    struct pollfdset pollfdset;             //owners of the pollfds are the sources
+    int scan_start;                         //poll backend starts looking for ready pollfds here
+    struct event_source wakeup_source;      //eventfd interrupting poll() when a source is re-armed
+    int wakeup_pending;
+    struct uring uring;
+    struct uring_slot *slots;
+    int slot_num;
+    int first_free_slot;
+    struct event_source *rearm[2 * EVENT_LOOP_MAX_EVENTS];  //sources returned by the previous wait and disarmed ones
+    int rearm_num;
+    pthread_mutex_t mutex;
+};
+
+int event_loop_init(struct event_loop *loop, int backend, int oneshot);
+
+void event_source_init(struct event_source *source, int fd, int events, void (*handler)(void *), void *arg);
+
+//the source is armed when it is added
+int event_loop_add(struct event_loop *loop, struct event_source *source);
+
+//does nothing if events of the source are already equal to events
+int event_loop_set_events(struct event_loop *loop, struct event_source *source, int events);
+
+//called by the handler of one-shot loop when it's done with the source, does nothing in level triggered loop
+int event_loop_rearm(struct event_loop *loop, struct event_source *source);
+
+/*
+ * Returns 1 if the source was armed, after that it isn't returned by waits until it is re-armed, 0 if it wasn't.
+ * Level triggered loop re-arms it by the next wait, like the sources returned by a wait. It can re-arm only
+ * 2 * EVENT_LOOP_MAX_EVENTS sources, so it returns -1 and leaves the source armed if it already has that many.
+ * */
+int event_loop_disarm(struct event_loop *loop, struct event_source *source);
+
+int event_source_is_armed(struct event_source *source);
+
+void event_loop_remove(struct event_loop *loop, struct event_source *source);
+
+//puts ready sources to ready and returns their number or -1 on error
+int event_loop_wait(struct event_loop *loop, struct event_source **ready, int max_ready, int timeout);
+
+void event_loop_destroy(struct event_loop *loop);
+
+#endif //PROXY_EVENT_LOOP_H
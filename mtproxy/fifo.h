@@ -0,0 +1,54 @@
+/*
+ * Intrusive singly linked FIFO. The link is embedded into the element, like a timer, so adding
+ * and taking elements is O(1) and allocates nothing. An element is in one FIFO at a time.
+ * Not thread safe, the owner of the FIFO locks it if it needs to.
+ * */
+#ifndef PROXY_FIFO_H
+#define PROXY_FIFO_H
+
+#include "consts.h"
+#include <stddef.h>
+
+#define FIFO_INITIALIZER { NULL, NULL }
+
+//element that embeds the link as the member
+#define FIFO_ENTRY(link, type, member) ((type *) ((char *) (link) - offsetof(type, member)))
+
+struct fifo_link {
+    struct fifo_link *next;
+};
+
+struct fifo {
+    struct fifo_link *first, *last;
+};
+
+static inline void fifo_init(struct fifo *fifo) {
+    fifo->first = fifo->last = NULL;
+}
+
+static inline int fifo_is_empty(struct fifo *fifo) {
+    return fifo->first == NULL;
+}
+
+static inline void fifo_push(struct fifo *fifo, struct fifo_link *link) {
+    link->next = NULL;
+    if (fifo->first == NULL) {
+        fifo->first = link;
+    } else {
+        fifo->last->next = link;
+    }
+    fifo->last = link;
+}
+
+static inline struct fifo_link *fifo_peek(struct fifo *fifo) {
+    return fifo->first;
+}
+
+//returns NULL if the FIFO is empty
+static inline struct fifo_link *fifo_pop(struct fifo *fifo) {
+    struct fifo_link *link = fifo->first;
+    if (link != NULL) fifo->first = link->next;
+    return link;
+}
+
+#endif //PROXY_FIFO_H
@@ -1,18 +1,222 @@
 #include "handlers.h"
+#include "log.h"
 
-void try_parsing_response(struct server_handler_args *args, char *buffer, int res) {
+int header_name_is(struct phr_header *header, char *name) {
+    return header->name != NULL &&
+           header->name_len == strlen(name) &&
+           strncasecmp(header->name, name, header->name_len) == 0;
+}
+
+//checks if comma separated header value contains the token, e.g. "close" in "Connection: TE, close"
+int header_value_has_token(struct phr_header *header, char *token) {
+    size_t token_len = strlen(token), i = 0, start;
+    while (i < header->value_len) {
+        while (i < header->value_len && (header->value[i] == ' ' || header->value[i] == ',')) i++;
+        start = i;
+        while (i < header->value_len && header->value[i] != ',') i++;
+        if (i - start >= token_len && strncasecmp(header->value + start, token, token_len) == 0) {
+            size_t j;
+            for (j = start + token_len; j < i && header->value[j] == ' '; j++);
+            if (j == i) return 1;
+        }
+    }
+    return 0;
+}
+
+//returns -1 if the header is not a valid length
+ssize_t parse_content_length(struct phr_header *header) {
+    char value[32];
+    char *end;
+    long long len;
+    if (header->value_len == 0 || header->value_len >= sizeof(value)) return -1;
+    memcpy(value, header->value, header->value_len);
+    value[header->value_len] = '\0';
+    len = strtoll(value, &end, 10);
+    if (*end != '\0' || len < 0) return -1;
+    return (ssize_t) len;
+}
+
+//method is not null terminated, so its length is compared too, otherwise "G" and "GE" would be GET
+int method_is(const char *method, size_t method_len, const char *name) {
+    return method_len == strlen(name) && memcmp(method, name, method_len) == 0;
+}
+
+//hop-by-hop headers describe the connection to the proxy, so they are neither cached nor forwarded
+int is_hop_by_hop_header(struct phr_header *header) {
+    return header_name_is(header, CONNECTION_HEADER_NAME) ||
+           header_name_is(header, PROXY_CONNECTION_HEADER_NAME) ||
+           header_name_is(header, KEEP_ALIVE_HEADER_NAME) ||
+           header_name_is(header, "TE") ||
+           header_name_is(header, "Trailer") ||
+           header_name_is(header, "Upgrade");
+}
+
+//only responses with chunked as the single transfer coding are decoded, others are passed as they are
+int is_chunked_transfer_encoding(struct phr_header *header) {
+    return header_name_is(header, TRANSFER_ENCODING_HEADER_NAME) &&
+           memchr(header->value, ',', header->value_len) == NULL &&
+           header_value_has_token(header, "chunked");
+}
+
+/*
+ * When the last chunk is received, the header of the cache is replaced with the one with Content-Length,
+ * so that next clients can keep their connections alive.
+ * Clients that already received the old header find the end of the response by connection close.
+ * */
+int finish_chunked_response(struct server_handler_args *args) {
+    char content_length[64];
+    int res;
+    args->chunked = 0;
+    res = snprintf(content_length, sizeof(content_length), "%s: %zd\r\nConnection: keep-alive\r\n\r\n",
+                   CONTENT_LENGTH_HEADER_NAME, args->body_received);
+    res = realloc_buffer_add_bytes(&args->chunked_header, content_length, res);
+    if (res == 0) {
+        cache_set_content_length(args->cache, args->body_received);
+        res = cache_replace_first(args->cache, args->chunked_header.buffer, args->chunked_header.data_len);
+        if (res != 0) cache_set_content_length(args->cache, -1);
+    }
+    realloc_buffer_destroy(&args->chunked_header);
+    if (res != 0) {
+        LOG_ERROR("Couldn't replace header of chunked response: %s", strerror(errno));
+        cache_map_remove(args->cache_map, args->cache);
+    }
+    return HANDLER_FINISHED;
+}
+
+//checks if the whole body is received
+int server_count_body(struct server_handler_args *args, int len) {
+    ssize_t content_length = cache_get_content_length(args->cache);
+    args->body_received += len;
+    if (content_length >= 0 && args->body_received >= content_length) {
+        return HANDLER_FINISHED;
+    }
+    return HANDLER_CONTINUE;
+}
+
+/*
+ * If the length of the body is known, it is received right to the space reserved in the cache.
+ * Content-Length is not trusted for the size of the allocation, so the first node is of CACHE_SEGMENT_MIN_SIZE
+ * and every next one is twice as large, up to CACHE_SEGMENT_MAX_SIZE, as the bytes really arrive.
+ * Returns 0 if body should be received to the cache through a buffer.
+ * */
+int server_get_reserved_space(struct server_handler_args *args, char **space) {
+    ssize_t left, content_length = cache_get_content_length(args->cache);
+    int len = cache_get_free_space(args->cache, space);
+    if (len > 0 || args->chunked || content_length < 0) return len;
+    left = content_length - args->body_received;
+    if (left <= 0) return 0;
+    if (cache_reserve(args->cache, (int) (left < args->segment_size ? left : args->segment_size)) != 0) {
+        return 0;
+    }
+    if (args->segment_size < CACHE_SEGMENT_MAX_SIZE) args->segment_size *= 2;
+    return cache_get_free_space(args->cache, space);
+}
+
+//puts response body bytes to the cache and checks if the whole body is received
+int server_store_body(struct server_handler_args *args, char *bytes, int len) {
+    ssize_t decode_res = -2;
+    size_t decoded_len = len;
+    if (args->chunked) {
+        decode_res = phr_decode_chunked(&args->chunked_decoder, bytes, &decoded_len);
+        if (decode_res == -1) {
+            LOG_ERROR("Couldn't decode chunked response from server");
+            cache_map_remove(args->cache_map, args->cache);
+            return HANDLER_ERROR;
+        }
+        len = (int) decoded_len;
+    }
+    if (len > 0 && cache_add_bytes(args->cache, bytes, len) != 0) {
+        cache_map_remove(args->cache_map, args->cache);
+        return HANDLER_ERROR;
+    }
+    if (decode_res >= 0) {
+        args->body_received += len;
+        return finish_chunked_response(args);
+    }
+    return server_count_body(args, len);
+}
+
+/*
+ * Status line and headers are stored to the cache without hop-by-hop headers.
+ * Connection header is added instead, so that clients keep connection alive
+ * only if the end of the response can be found by Content-Length.
+ * Chunked body is stored decoded, so its Transfer-Encoding header is removed as well.
+ * */
+int store_response_header(struct server_handler_args *args, struct phr_header *headers, size_t num_headers,
+                          int has_body) {
+    struct realloc_buffer header;
+    char *status_line_end = memchr(args->header_buffer.buffer, '\n', args->header_buffer.data_len);
+    char *connection;
+    size_t i;
+    int skip = 0, res = 0;
+
+    for (i = 0; i < num_headers; i++) {
+        if (has_body && is_chunked_transfer_encoding(&headers[i])) {
+            args->chunked = 1;
+            memset(&args->chunked_decoder, 0, sizeof(args->chunked_decoder));
+            args->chunked_decoder.consume_trailer = 1;
+        }
+    }
+    realloc_buffer_init(&header);
+    res |= realloc_buffer_add_bytes(&header, args->header_buffer.buffer,
+                                    status_line_end - args->header_buffer.buffer + 1);
+    for (i = 0; i < num_headers; i++) {
+        if (headers[i].name == NULL) {
+            if (skip) continue;
+            res |= realloc_buffer_add_bytes(&header, " ", 1);
+        } else {
+            skip = is_hop_by_hop_header(&headers[i]) ||
+                   (args->chunked && (is_chunked_transfer_encoding(&headers[i]) ||
+                                      header_name_is(&headers[i], CONTENT_LENGTH_HEADER_NAME)));
+            if (skip) continue;
+            if (header_name_is(&headers[i], CONTENT_LENGTH_HEADER_NAME)) {
+                cache_set_content_length(args->cache, parse_content_length(&headers[i]));
+            }
+            res |= realloc_buffer_add_bytes(&header, (char *) headers[i].name, headers[i].name_len);
+            res |= realloc_buffer_add_bytes(&header, ": ", 2);
+        }
+        res |= realloc_buffer_add_bytes(&header, (char *) headers[i].value, headers[i].value_len);
+        res |= realloc_buffer_add_bytes(&header, "\r\n", 2);
+    }
+    //headers of a bodiless response describe the body it would have, they are kept but nothing is waited for
+    if (!has_body) cache_set_content_length(args->cache, 0);
+    if (args->chunked) {
+        //header is completed with Content-Length when the whole body is received
+        res |= realloc_buffer_add_bytes(&args->chunked_header, header.buffer, header.data_len);
+    }
+    connection = (cache_get_content_length(args->cache) >= 0 ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    res |= realloc_buffer_add_bytes(&header, connection, strlen(connection));
+    if (res == 0) {
+        res = cache_add_bytes(args->cache, header.buffer, header.data_len);
+    }
+    realloc_buffer_destroy(&header);
+    return res;
+}
+
+//stores bytes received before the header could be parsed as they are
+int store_raw_header(struct server_handler_args *args) {
+    int res = 0;
+    if (args->header_buffer.data_len > 0) {
+        res = cache_add_bytes(args->cache, args->header_buffer.buffer, args->header_buffer.data_len);
+    }
+    args->header_finished_flag = 1;
+    realloc_buffer_destroy(&args->header_buffer);
+    return res;
+}
+
+int try_parsing_response(struct server_handler_args *args, char *buffer, int len) {
     struct phr_header headers[NUM_HEADERS];
-    int minor_version, status;
+    int minor_version, status, res;
     size_t msg_len, num_headers;
-    char msg[HTTP_MSG_LEN_MAX];
+    char *msg, *reserved_space;
 
-    res = realloc_buffer_add_bytes(&args->header_buffer, buffer, res);
+    res = realloc_buffer_add_bytes(&args->header_buffer, buffer, len);
     if (res < 0) {
-        perror("Realloc buffer for response didn't work");
+        LOG_ERROR("Realloc buffer for response didn't work: %s", strerror(errno));
         args->header_finished_flag = 1;
         realloc_buffer_destroy(&args->header_buffer);
         cache_map_remove(args->cache_map, args->cache);
-        return;
+        return HANDLER_ERROR;
     }
     num_headers = NUM_HEADERS;
     res = phr_parse_response((const char *) args->header_buffer.buffer,
@@ -21,82 +225,103 @@ void try_parsing_response(struct server_handler_args *args, char *buffer, int re
                              (const char **) &msg, &msg_len,
                              headers, &num_headers,
                              args->header_buffer.prev_data_len);
-    if (res == -2)
-        return; //continue receiving request as it was not fully received
+    if (res == -2) {
+        if (len != 0)
+            return HANDLER_CONTINUE; //continue receiving response as it was not fully received
+        LOG_DEBUG("Server closed connection before the response header have been received");
+        cache_map_remove(args->cache_map, args->cache);
+        return (store_raw_header(args) == 0 ? HANDLER_FINISHED : HANDLER_ERROR);
+    }
     if (res == -1) {
-        fprintf(stderr, "Couldn't parse response from server: %s\n", strerror(errno));
+        LOG_ERROR("Couldn't parse response from server: %s", strerror(errno));
         cache_map_remove(args->cache_map, args->cache);
-    } else if (status != 200) {
+        if (store_raw_header(args) != 0) return HANDLER_ERROR;
+        return (len == 0 ? HANDLER_FINISHED : HANDLER_CONTINUE);
+    }
+    if (status != 200) {
         cache_map_remove(args->cache_map, args->cache);
-        puts("Cache removed from map as it its status is not OK");
+        LOG_DEBUG("Cache removed from map as it its status is not OK");
+    }
+    //responses to HEAD, 204 and 304 end with the header
+    if (store_response_header(args, headers, num_headers,
+                              !args->head_request && status != 204 && status != 304) != 0) {
+        cache_map_remove(args->cache_map, args->cache);
+        return HANDLER_ERROR;
     }
-    printf("---------------------------------------------\n"//Дебажный вывод надо будет убрать
-           "received RESPONSE:"
-           "%.*s\n"
-           "---------------------------------------------\n", (int) args->header_buffer.data_len,
-           args->header_buffer.buffer);
     args->header_finished_flag = 1;
+    //the rest of the buffer is the start of the body, it goes to the reserved space
+    server_get_reserved_space(args, &reserved_space);
+    len = server_store_body(args, args->header_buffer.buffer + res, args->header_buffer.data_len - res);
     realloc_buffer_destroy(&args->header_buffer);
+    return len;
 }
 
 int server_handle_in(struct server_handler_args *args) {
     char buffer[SERVER_RECV_BUFFER_SIZE];
+    char *reserved_space;
+    int res, reserved_len = 0;
+    if (args->header_finished_flag) {
+        reserved_len = server_get_reserved_space(args, &reserved_space);
+    }
 //    printf("######################################Receiving from server... \n");
-    int res = recv(args->socket, buffer, SERVER_RECV_BUFFER_SIZE, SERVER_RECV_FLAGS);
+    if (reserved_len > 0) {
+        res = recv(args->socket, reserved_space, reserved_len, SERVER_RECV_FLAGS);
+    } else {
+        res = recv(args->socket, buffer, SERVER_RECV_BUFFER_SIZE, SERVER_RECV_FLAGS);
+    }
 //    printf("##################################done receiving from server %d\n", res);
     if (res < 0) {
         if (errno == EINTR) return HANDLER_EINTR;
+        if (errno == EWOULDBLOCK || errno == EAGAIN) return HANDLER_WOULDBLOCK;
         cache_map_remove(args->cache_map, args->cache);
-        fprintf(stderr, "Server recv failed with: %s\n", strerror(errno));
+        LOG_ERROR("Server recv failed with: %s", strerror(errno));
         return HANDLER_ERROR;
     }
+    args->bytes_transferred += res;
+    gettimeofday(&args->last_active_time, NULL);
+    args->response_started = 1;
     if (!args->header_finished_flag) {
-        try_parsing_response(args, buffer, res);
+        return try_parsing_response(args, buffer, res);
     }
     if (res == 0) {
         return HANDLER_FINISHED;
     }
-    if (cache_add_bytes(args->cache, buffer, res) != 0) {
-        cache_map_remove(args->cache_map, args->cache);
-        return HANDLER_ERROR;
+    if (reserved_len > 0) {
+        cache_commit_bytes(args->cache, res);
+        return server_count_body(args, res);
     }
-    return HANDLER_CONTINUE;
+    return server_store_body(args, buffer, res);
 }
 
 int server_handle_out(struct server_handler_args *args) {
-    char *bytes;
     int res;
-    puts("getting bytes");
-    res = cache_reader_get_bytes(&args->reader, &bytes);
-    puts("got bytes");
-    if (res == ECACHE_FINISHED) {
-        cache_reader_release_cache(&args->reader);
-        return HANDLER_FINISHED;
-    }
-    if (res == ECACHE_WOULDBLOCK) return HANDLER_CONTINUE;
-
-    res = send(args->socket, bytes, res, SERVER_SEND_FLAGS);
+    res = realloc_buffer_send(args->socket, &args->request, args->request_sent,
+                              args->request.data_len - args->request_sent, SERVER_SEND_FLAGS);
     if (res < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            return HANDLER_CONTINUE;
+            return HANDLER_WOULDBLOCK;
         } else if (errno == EINTR) {
             return HANDLER_EINTR;
         } else {
-            fprintf(stderr, "Server send() failed with: %s\n", strerror(errno));
+            LOG_ERROR("Server send() failed with: %s", strerror(errno));
             return HANDLER_ERROR;
         }
     }
-    cache_reader_skip_bytes(&args->reader, res);
+    args->request_sent += res;
+    args->bytes_transferred += res;
+    if (args->request_sent == args->request.data_len) {
+        realloc_buffer_destroy(&args->request);
+        return HANDLER_FINISHED;
+    }
     return HANDLER_CONTINUE;
 }
 
-int connect_to_server(char *host) {
+int connect_to_server(char *host, int blocking) {
     int ret, sock;
     char *port = DEFAULT_PORT_STRING;
-    struct sockaddr_in server_addr;
     struct addrinfo *ip_struct;
     struct addrinfo hints;
-    printf("Connecting to server %s\n", host);
+    LOG_DEBUG("Connecting to server %s", host);
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -104,24 +329,98 @@ int connect_to_server(char *host) {
     hints.ai_protocol = 0;
 
     if ((ret = getaddrinfo(host, port, &hints, &ip_struct)) != 0) {
-        fprintf(stderr, "getaddrinfo() failed with %s\n", gai_strerror(ret));
+        LOG_ERROR("getaddrinfo() failed with %s", gai_strerror(ret));
         return -1;
     }
-    if ((sock = socket(ip_struct->ai_family, ip_struct->ai_socktype,
+    if ((sock = socket(ip_struct->ai_family,
+                       ip_struct->ai_socktype | (blocking ? BLOCKING_SERVER_SOCKET_FLAGS : SERVER_SOCKET_FLAGS),
                        ip_struct->ai_protocol)) == -1) {
-        fprintf(stderr, "Error: socket() failed with %s\n", strerror(errno));
+        LOG_ERROR("Error: socket() failed with %s", strerror(errno));
+        freeaddrinfo(ip_struct);
         return -1;
     }
-    if (connect(sock, ip_struct->ai_addr, ip_struct->ai_addrlen) != 0) {
-        fprintf(stderr, "Error: connect() failed with %s\n", strerror(errno));
+    //non-blocking connect is finished in the background, the socket becomes writable when it is done
+    if (connect(sock, ip_struct->ai_addr, ip_struct->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        LOG_ERROR("Error: connect() failed with %s", strerror(errno));
+        freeaddrinfo(ip_struct);
+        close(sock);
         return -1;
     }
-    printf("Connected to %s\n", host);
+    freeaddrinfo(ip_struct);
+    LOG_DEBUG("Connected to %s", host);
     return sock;
 }
 
-int start_server(struct client_handler_args *client, struct cache *cache, char *key, char *host,
-                 struct cache *server_request_cache) {
+int server_connect(struct server_handler_args *server, int blocking) {
+    server->socket = connect_to_server(server->host, blocking);
+    return (server->socket < 0 ? -1 : 0);
+}
+
+/*
+ * Builds the whole request to the server in one buffer allocated at once.
+ * GET requests are cached, so only Host is sent with them, to get the response that suits every client.
+ * Other requests are forwarded with client headers and body, except hop-by-hop headers.
+ * */
+int build_server_request(struct realloc_buffer *request, char *method, size_t method_len, char *path, size_t path_len,
+                         char *host, struct phr_header *headers, size_t num_headers, char *body, size_t body_len) {
+    char *http_and_host = " HTTP/1.1\r\nHost: ";
+    char *end = "\r\nConnection: close\r\n\r\n";
+    int forward_headers = !method_is(method, method_len, "GET");
+    char content_length[64];
+    size_t i;
+    int skip = 0, res = 0, content_length_len = 0;
+    size_t len = method_len + 1 + path_len + strlen(http_and_host) + strlen(host) + strlen(end) + body_len;
+
+    //body is forwarded decoded, so its length is sent instead of the framing headers of the client
+    if (forward_headers || body_len > 0) {
+        content_length_len = snprintf(content_length, sizeof(content_length), "\r\n%s: %zu",
+                                      CONTENT_LENGTH_HEADER_NAME, body_len);
+        len += content_length_len;
+    }
+
+    if (forward_headers) {
+        for (i = 0; i < num_headers; i++) {
+            len += headers[i].name_len + 2 + headers[i].value_len + 2;
+        }
+    }
+    realloc_buffer_init(request);
+    if (realloc_buffer_reserve(request, len) != 0) {
+        return -1;
+    }
+    res |= realloc_buffer_add_bytes(request, method, method_len);
+    res |= realloc_buffer_add_bytes(request, " ", 1);
+    res |= realloc_buffer_add_bytes(request, path, path_len);
+    res |= realloc_buffer_add_bytes(request, http_and_host, strlen(http_and_host));
+    res |= realloc_buffer_add_bytes(request, host, strlen(host));
+    for (i = 0; forward_headers && i < num_headers; i++) {
+        if (headers[i].name == NULL) {
+            if (skip) continue;
+            res |= realloc_buffer_add_bytes(request, " ", 1);
+        } else {
+            skip = is_hop_by_hop_header(&headers[i]) || header_name_is(&headers[i], HOST_HEADER_NAME) ||
+                   header_name_is(&headers[i], CONTENT_LENGTH_HEADER_NAME) ||
+                   header_name_is(&headers[i], TRANSFER_ENCODING_HEADER_NAME);
+            if (skip) continue;
+            res |= realloc_buffer_add_bytes(request, "\r\n", 2);
+            res |= realloc_buffer_add_bytes(request, (char *) headers[i].name, headers[i].name_len);
+            res |= realloc_buffer_add_bytes(request, ": ", 2);
+        }
+        res |= realloc_buffer_add_bytes(request, (char *) headers[i].value, headers[i].value_len);
+    }
+    res |= realloc_buffer_add_bytes(request, content_length, content_length_len);
+    res |= realloc_buffer_add_bytes(request, end, strlen(end));
+    if (body_len > 0) {
+        res |= realloc_buffer_add_bytes(request, body, body_len);
+    }
+    if (res != 0) {
+        realloc_buffer_destroy(request);
+        return -1;
+    }
+    return 0;
+}
+
+int start_server(struct client_handler_args *client, struct cache *cache, char *host,
+                 struct realloc_buffer *request, int head_request) {
     int res;
     struct server_handler_args *server = (struct server_handler_args *) malloc(sizeof(struct server_handler_args));
 
@@ -130,30 +429,32 @@ int start_server(struct client_handler_args *client, struct cache *cache, char *
         return -1;
     }
     realloc_buffer_init(&server->header_buffer);
+    realloc_buffer_init(&server->chunked_header);
+    server->chunked = 0;
+    server->head_request = head_request;
+    server->segment_size = CACHE_SEGMENT_MIN_SIZE;
     server->socket = -1;
     server->cache = NULL;
-    server->reader.cache_node = NULL;
-    server->socket = connect_to_server(host);
-    if (server->socket < 0) {
-        return -1;
-    }
+    strcpy(server->host, host);
 
-
-    cache_init_reader(server_request_cache, &server->reader);
-//    cache_finish(server_request_cache);
-//    cache_release(&server_request_cache);
+    server->request = *request;
+    server->request_sent = 0;
+    realloc_buffer_init(request);
     server->cache_map = client->cache_map;
     server->cache = cache;
     cache_add_user(cache);
     server->header_finished_flag = 0;
-    res = client->create_server_handler(server);
+    server->body_received = 0;
+    server->bytes_transferred = 0;
+    server->response_started = 0;
+    gettimeofday(&server->last_active_time, NULL);
+    res = client->create_server_handler(server, client->context);
     if (res < 0) {
         return -1;
     }
     return 0;
 }
 
-
 int client_handle_request(struct client_handler_args *client,
                           struct phr_header *headers,
                           size_t num_headers,
@@ -161,177 +462,391 @@ int client_handle_request(struct client_handler_args *client,
                           size_t path_len,
                           int minor_version,
                           char *method,
-                          size_t method_len) {
+                          size_t method_len,
+                          size_t header_len,
+                          size_t request_len) {
     char host[MAX_HOST_NAME_LEN];
     char key[CACHE_KEY_MAX_SIZE];
-    int cache_created_flag, i;
+    int cache_created_flag;
+    size_t i;
     struct cache *cache;
     int error = 0;
 
     if (minor_version == 9) {
-        perror("Unsupported http version\n");
+        LOG_WARN("Unsupported http version");
         return HANDLER_ERROR;
     }
     for (i = 0; i != num_headers; ++i) {
-        if (strncmp(headers[i].name, HOST_HEADER_NAME, headers[i].name_len) == 0) {
+        if (header_name_is(&headers[i], HOST_HEADER_NAME)) {
             if (headers[i].value_len < MAX_HOST_NAME_LEN) {
                 memcpy(host, headers[i].value, headers[i].value_len);
                 host[headers[i].value_len] = '\0';
             } else {
-                perror("Host name is too long");
+                LOG_WARN("Host name is too long");
                 return HANDLER_ERROR;
             }
             break;
         }
     }
     if (i == num_headers) {
-        perror("Host header not found\n");
+        LOG_WARN("Host header not found");
         return HANDLER_ERROR;
     }
     i = strlen(host);
     if (path_len + i >= CACHE_KEY_MAX_SIZE) {
-        printf("Path is to long %d, %d, %.*s\n", path_len, i, path_len, path);
+        LOG_WARN("Path is to long %d, %d, %.*s", (int) path_len, (int) i, (int) path_len, path);
         return HANDLER_ERROR;
     }
     strcpy(key, host);
     strncat(key, path, path_len);
-    if (strncmp(method, "GET\0", method_len)) {
-        printf("Method %.*s is not supposed to be cached\n", method_len, method);
+    if (!method_is(method, method_len, "GET")) {
+        LOG_DEBUG("Method %.*s is not supposed to be cached", (int) method_len, method);
         cache = cache_create(key);
         cache_created_flag = CACHE_CREATED;
         if (cache == NULL) {
-            perror("couldn't create cache for client\n");
+            LOG_ERROR("couldn't create cache for client: %s", strerror(errno));
             return HANDLER_ERROR;
         }
     } else {
         cache = cache_map_get_or_create(client->cache_map, key, &cache_created_flag);
         if (cache == NULL) {
-            perror("couldn't create cache for client\n");
+            LOG_ERROR("couldn't create cache for client: %s", strerror(errno));
             return HANDLER_ERROR;
         }
     }
-    printf("Cache created flag value: %d\n", cache_created_flag);
+    LOG_DEBUG("Cache created flag value: %d", cache_created_flag);
+    log_access(key, strlen(key), cache_created_flag == CACHE_FOUND);
     if (cache_created_flag == CACHE_CREATED) {
-        struct cache *server_request_cache = cache_create("SERVER REQUEST CACHE");
-        if (server_request_cache == NULL) {
+        struct realloc_buffer request;
+        if (build_server_request(&request, method, method_len, path, path_len, host, headers, num_headers,
+                                 client->request_buffer.buffer + header_len, request_len - header_len) != 0) {
+            LOG_ERROR("Couldn't build request to server: %s", strerror(errno));
             error = 1;
         } else {
-            if (start_server(client, cache, key, host, server_request_cache) < 0) {
+            if (start_server(client, cache, host, &request, method_is(method, method_len, "HEAD")) < 0) {
                 error = 1;
-            } else if (strncmp(method, "GET\0", method_len) == 0) {
-                char *get = "GET ";
-                char *http_and_host = " HTTP/1.0\r\nHost: ";
-                char *end = "\r\n\r\n";
-                cache_add_bytes(server_request_cache, get, strlen(get));
-                cache_add_bytes(server_request_cache, path, path_len);
-                cache_add_bytes(server_request_cache, http_and_host, strlen(http_and_host));
-                cache_add_bytes(server_request_cache, host, strlen(host));
-                cache_add_bytes(server_request_cache, end, strlen(end));
-            } else {
-                if (cache_add_bytes(server_request_cache, client->request_buffer.buffer,
-                                    client->request_buffer.data_len) != 0) {
-                    error = 1;
-                }
             }
-            cache_finish(server_request_cache);
-            cache_release(&server_request_cache);
+            realloc_buffer_destroy(&request);
         }
     }
     if (error) {
         cache_release(&cache);
         cache = NULL;
-        realloc_buffer_destroy(&client->request_buffer);
         return HANDLER_ERROR;
     }
-    cache_init_reader(cache, &client->reader);
+    if (client->reader.cache == NULL) {
+        cache_init_reader(cache, &client->reader);
+    } else {
+        struct pending_reader *pending = (struct pending_reader *) malloc(sizeof(struct pending_reader));
+        if (pending == NULL) {
+            cache_release(&cache);
+            return HANDLER_ERROR;
+        }
+        cache_init_reader(cache, &pending->reader);
+        fifo_push(&client->pending_readers, &pending->link);
+        client->pending_num++;
+    }
     cache_release(&cache);
-    realloc_buffer_destroy(&client->request_buffer);
     return HANDLER_FINISHED;
 }
 
-int client_handle_in(struct client_handler_args *client) {
-    size_t method_len, path_len, num_headers = NUM_HEADERS;
-    int pret, minor_version, rret;
+//HTTP/1.1 connections are persistent unless client asks to close it, HTTP/1.0 are persistent only if client asks
+int request_keeps_connection_alive(struct phr_header *headers, size_t num_headers, int minor_version) {
+    size_t i;
+    for (i = 0; i < num_headers; i++) {
+        if (header_name_is(&headers[i], CONNECTION_HEADER_NAME) ||
+            header_name_is(&headers[i], PROXY_CONNECTION_HEADER_NAME)) {
+            if (header_value_has_token(&headers[i], "close")) return 0;
+            if (header_value_has_token(&headers[i], "keep-alive")) return 1;
+        }
+    }
+    return minor_version >= 1;
+}
+
+/*
+ * Chunked body of a request is decoded in place right after its header as its bytes come,
+ * the bytes after the last chunk are moved right after the decoded body, they start the next request.
+ * Returns the length of the decoded body once the last chunk is received, -2 if it isn't yet, -1 if it's malformed.
+ * */
+ssize_t decode_request_body(struct client_handler_args *client, size_t header_len) {
+    size_t len;
+    ssize_t res;
+    if (!client->header_received) {
+        memset(&client->chunked_decoder, 0, sizeof(client->chunked_decoder));
+        client->chunked_decoder.consume_trailer = 1;
+        client->body_decoded = 0;
+    }
+    len = client->request_buffer.data_len - header_len - client->body_decoded;
+    res = phr_decode_chunked(&client->chunked_decoder,
+                             client->request_buffer.buffer + header_len + client->body_decoded, &len);
+    if (res == -1) return -1;
+    client->body_decoded += len;
+    client->request_buffer.data_len = header_len + client->body_decoded + (res > 0 ? res : 0);
+    return (res < 0 ? -2 : (ssize_t) client->body_decoded);
+}
+
+/*
+ * Parses one request from the beginning of the request buffer and removes it from the buffer.
+ * Returns HANDLER_CONTINUE if the request is not fully received yet
+ * */
+int client_parse_request(struct client_handler_args *client) {
+    size_t method_len, path_len, num_headers = NUM_HEADERS, request_len;
+    ssize_t body_len = 0;
+    size_t i;
+    int pret, minor_version, res, chunked = 0;
     struct phr_header headers[NUM_HEADERS];
     char *method, *path;
 
-    rret = realloc_buffer_recv(client->socket, &client->request_buffer, CLIENT_RECV_BUFFER_LENGTH, CLIENT_RECV_FLAGS);
-    if (rret == 0) {
-        puts("Client closed connection before the request have been red");
+    if (client->request_buffer.data_len == 0) return HANDLER_CONTINUE;
+    //header of a request whose body is being received ends before the previous data, it's parsed from the start
+    pret = phr_parse_request(client->request_buffer.buffer, client->request_buffer.data_len,
+                             (const char **) &method, &method_len,
+                             (const char **) &path, &path_len, &minor_version, headers, &num_headers,
+                             client->header_received ? 0 : client->request_buffer.prev_data_len);
+
+    if (pret == -2) return HANDLER_CONTINUE; //continue receiving request as it was not fully received
+    if (pret == -1) {
+        LOG_WARN("Couldn't parse request from client");
+        return HANDLER_ERROR;
+    }
+    for (i = 0; i < num_headers; i++) {
+        if (header_name_is(&headers[i], CONTENT_LENGTH_HEADER_NAME)) {
+            body_len = parse_content_length(&headers[i]);
+            if (body_len < 0) {
+                LOG_WARN("Invalid Content-Length in request from client");
+                return HANDLER_ERROR;
+            }
+        } else if (header_name_is(&headers[i], TRANSFER_ENCODING_HEADER_NAME)) {
+            //end of a body in other codings can't be found, so it's never forwarded partially
+            if (!is_chunked_transfer_encoding(&headers[i])) {
+                LOG_WARN("Unsupported Transfer-Encoding in request from client");
+                return HANDLER_ERROR;
+            }
+            chunked = 1;
+        }
+    }
+    //Transfer-Encoding overrides Content-Length
+    if (chunked) {
+        body_len = decode_request_body(client, pret);
+        if (body_len == -1) {
+            LOG_WARN("Couldn't decode chunked body of request from client");
+            return HANDLER_ERROR;
+        }
+    }
+    request_len = pret + body_len;
+    if (body_len == -2 || request_len > client->request_buffer.data_len) {
+        client->header_received = 1;
+        return HANDLER_CONTINUE; //continue receiving request body
+    }
+    //set only when the request is whole, the rest of its body would not be parsed otherwise
+    if (!request_keeps_connection_alive(headers, num_headers, minor_version)) {
+        client->in_finished = 1;
+    }
+    res = client_handle_request(client, headers, num_headers, path, path_len, minor_version, method, method_len,
+                                pret, request_len);
+    if (res == HANDLER_ERROR) return HANDLER_ERROR;
+    if (realloc_buffer_remove_bytes_at_start(&client->request_buffer, request_len) != 0) {
+        LOG_ERROR("Couldn't remove request from the buffer: %s", strerror(errno));
         return HANDLER_ERROR;
     }
-    if (rret < 0) {
+    client->request_buffer.prev_data_len = 0;
+    client->header_received = 0;
+    //bytes left in the buffer are the start of the next pipelined request
+    client->request_start_time = client->last_active_time;
+    return HANDLER_FINISHED;
+}
+
+int client_pipeline_full(struct client_handler_args *client) {
+    return client->pending_num >= MAX_PIPELINED_REQUESTS;
+}
+
+/*
+ * Client may send several requests without waiting for responses, all of them are handled in order.
+ * Every request may start a server, so requests beyond MAX_PIPELINED_REQUESTS queued responses are left
+ * in the buffer until the responses before them are sent. Returns HANDLER_WOULDBLOCK if the pipeline is full.
+ * */
+int client_parse_requests(struct client_handler_args *client) {
+    int res;
+    while (!client->in_finished) {
+        if (client_pipeline_full(client)) return HANDLER_WOULDBLOCK;
+        res = client_parse_request(client);
+        if (res != HANDLER_FINISHED) return res;
+    }
+    return HANDLER_FINISHED;
+}
+
+int client_handle_in(struct client_handler_args *client) {
+    int res, request_started = client->request_buffer.data_len > 0;
+
+    //socket isn't read while the pipeline is full, so the kernel pushes back on the client
+    if (client_pipeline_full(client)) return HANDLER_WOULDBLOCK;
+    res = realloc_buffer_recv(client->socket, &client->request_buffer, CLIENT_RECV_BUFFER_LENGTH, CLIENT_RECV_FLAGS);
+    if (res == 0) {
+        LOG_DEBUG("Client closed connection");
+        client->in_finished = 1;
+        return HANDLER_FINISHED;
+    }
+    if (res < 0) {
         if (errno == EINTR) {
             return HANDLER_EINTR;
         }
-        fprintf(stderr, "Couldn't read request from client: %s\n", strerror(errno));
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return HANDLER_WOULDBLOCK;
+        }
+        LOG_WARN("Couldn't read request from client: %s", strerror(errno));
         return HANDLER_ERROR;
     }
-    pret = phr_parse_request(client->request_buffer.buffer, client->request_buffer.data_len,
-                             (const char **) &method, &method_len,
-                             (const char **) &path, &path_len,
-                             &minor_version, headers, &num_headers, client->request_buffer.prev_data_len);
+    client->bytes_transferred += res;
+    gettimeofday(&client->last_active_time, NULL);
+    if (!request_started) client->request_start_time = client->last_active_time;
+    return client_parse_requests(client);
+}
 
-    if (pret == -2) return HANDLER_CONTINUE; //continue receiving request as it was not fully received
-    if (pret == -1) {
-        fprintf(stderr, "Couldn't parse request from client\n");
-        return HANDLER_ERROR;
+//releases the reader of the sent response and starts sending the next one
+int client_finish_response(struct client_handler_args *args) {
+    struct fifo_link *next;
+    struct pending_reader *pending;
+    int delimited = cache_get_content_length(args->reader.cache) >= 0 && cache_reader_started_from_first(&args->reader);
+    cache_reader_release_cache(&args->reader);
+    if (!delimited) {
+        //client can find the end of this response only by connection close
+        return HANDLER_FINISHED;
     }
-    printf("--------REQUEST FROM CLIENT-------------------------------------\n"
-           "%.*s"
-           "----------------------------------------------------------------\n",
-           client->request_buffer.data_len, client->request_buffer.buffer);
-    shutdown(client->socket, SHUT_RD);
-    return client_handle_request(client, headers, num_headers, path, path_len, minor_version, method, method_len);
+    next = fifo_pop(&args->pending_readers);
+    if (next != NULL) {
+        pending = FIFO_ENTRY(next, struct pending_reader, link);
+        args->reader = pending->reader;
+        free(pending);
+        //requests left in the buffer by the full pipeline are parsed once it has room, no new bytes may come for them
+        if (args->pending_num-- == MAX_PIPELINED_REQUESTS && args->request_buffer.data_len > 0 &&
+            client_parse_requests(args) == HANDLER_ERROR) {
+            return HANDLER_ERROR;
+        }
+        return HANDLER_CONTINUE;
+    }
+    return (args->in_finished ? HANDLER_FINISHED : HANDLER_WAITING);
 }
 
 int client_handle_out(struct client_handler_args *args) {
     int res;
     char *bytes;
+    if (args->reader.cache == NULL) {
+        return (args->in_finished ? HANDLER_FINISHED : HANDLER_WAITING);
+    }
     res = cache_reader_get_bytes(&args->reader, &bytes);
-    if (res == ECACHE_WOULDBLOCK) return HANDLER_CONTINUE;
+    if (res == ECACHE_WOULDBLOCK && args->blocking) {
+        cache_reader_wait(&args->reader);
+        res = cache_reader_get_bytes(&args->reader, &bytes);
+    }
+    if (res == ECACHE_WOULDBLOCK) return HANDLER_WOULDBLOCK;
     if (res == ECACHE_FINISHED) {
-        cache_reader_release_cache(&args->reader);
-        return HANDLER_FINISHED;
+        return client_finish_response(args);
     }
 //    printf("Sending to client  %d\n", res);
     res = send(args->socket, bytes, res, CLIENT_SEND_FLAGS);
 //    printf("Sent %d\n", res);
     if (res < 0) {
         if (errno == EINTR) return HANDLER_EINTR;
-        fprintf(stderr, "Client send failed with: %s\n", strerror(errno));
+        if (errno == EWOULDBLOCK || errno == EAGAIN) return HANDLER_WOULDBLOCK;
+        LOG_WARN("Client send failed with: %s", strerror(errno));
         return HANDLER_ERROR;
     }
+    args->bytes_transferred += res;
+    gettimeofday(&args->last_active_time, NULL);
     cache_reader_skip_bytes(&args->reader, res);
     return HANDLER_CONTINUE;
 }
 
+int client_has_response(struct client_handler_args *args) {
+    return args->reader.cache != NULL;
+}
+
+int client_wants_request(struct client_handler_args *args) {
+    return !args->in_finished && !client_pipeline_full(args);
+}
+
+int client_deadline(struct client_handler_args *args, struct timeval *deadline) {
+    if (client_has_response(args)) return 0;
+    if (args->request_buffer.data_len > 0 && !args->header_received) {
+        *deadline = args->request_start_time;
+        deadline->tv_sec += CLIENT_HEADER_TIMEOUT;
+    } else {
+        *deadline = args->last_active_time;
+        deadline->tv_sec += CLIENT_IDLE_TIMEOUT;
+    }
+    return 1;
+}
+
+int client_timed_out(struct client_handler_args *args, struct timeval *now) {
+    struct timeval deadline;
+    return client_deadline(args, &deadline) && !timercmp(now, &deadline, <);
+}
+
+void server_deadline(struct server_handler_args *args, struct timeval *deadline) {
+    *deadline = args->last_active_time;
+    deadline->tv_sec += (args->response_started ? SERVER_RECV_TIMEOUT : SERVER_FIRST_BYTE_TIMEOUT);
+}
+
+int server_timed_out(struct server_handler_args *args, struct timeval *now) {
+    struct timeval deadline;
+    server_deadline(args, &deadline);
+    return !timercmp(now, &deadline, <);
+}
+
 int client_handler_args_init(struct client_handler_args *args,
                              int sockfd,
-                             int (*create_server_handler)(struct server_handler_args *),
+                             int (*create_server_handler)(struct server_handler_args *, void *context),
+                             void *context,
                              struct cache_map *cache_map) {
     args->create_server_handler = create_server_handler;
+    args->context = context;
     args->socket = sockfd;
     realloc_buffer_init(&args->request_buffer);
     args->cache_map = cache_map;
     args->reader.cache = NULL;
     args->reader.cache_node = NULL;
+    args->reader.first_node = NULL;
     args->reader.offset = 0;
+    fifo_init(&args->pending_readers);
+    args->pending_num = 0;
+    args->in_finished = 0;
+    args->header_received = 0;
+    args->body_decoded = 0;
+    args->blocking = 0;
+    args->bytes_transferred = 0;
+    gettimeofday(&args->last_active_time, NULL);
+    args->request_start_time = args->last_active_time;
     return 0;
 }
 
 void destroy_client(struct client_handler_args *client) {
+    struct fifo_link *link;
+    struct pending_reader *pending;
     realloc_buffer_destroy(&client->request_buffer);
     close(client->socket);
     client->socket = -1;
     cache_reader_release_cache(&client->reader);
+    while ((link = fifo_pop(&client->pending_readers)) != NULL) {
+        pending = FIFO_ENTRY(link, struct pending_reader, link);
+        cache_reader_release_cache(&pending->reader);
+        free(pending);
+    }
 }
 
 void destroy_server(struct server_handler_args *server) {
+    ssize_t content_length = (server->cache != NULL ? cache_get_content_length(server->cache) : -1);
+    if (server->cache != NULL && (!server->header_finished_flag ||
+        server->chunked ||
+        (content_length >= 0 && server->body_received < content_length))) {
+        //response is incomplete, clients have to find it out by connection close
+        cache_set_content_length(server->cache, -1);
+        cache_map_remove(server->cache_map, server->cache);
+    }
     cache_finish(server->cache);
     cache_release(&server->cache);
-    cache_reader_release_cache(&server->reader);
+    realloc_buffer_destroy(&server->request);
     realloc_buffer_destroy(&server->header_buffer);
+    realloc_buffer_destroy(&server->chunked_header);
     close(server->socket);
     server->socket = -1;
     free(server);
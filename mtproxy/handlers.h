@@ -6,17 +6,37 @@
 #include "cache.h"
 #include "realloc_buffer.h"
 #include "picohttpparser.h"
+#include "fifo.h"
 
 #define HANDLER_FINISHED 1
 #define HANDLER_CONTINUE 0
 #define HANDLER_EINTR 2
 #define HANDLER_ERROR -1
+#define HANDLER_WAITING 3   //every response is sent, connection is kept alive waiting for the next request
+#define HANDLER_WOULDBLOCK 4    //socket is not ready or the response has no new bytes, nothing was done
+
+//reader of a pipelined response, waits in the FIFO of its client until the responses before it are sent
+struct pending_reader {
+    struct cache_reader reader;
+    struct fifo_link link;
+};
 
 struct server_handler_args {
-    int socket;
+    int socket;                         //-1 until server_connect() is called
+    char host[MAX_HOST_NAME_LEN];
     struct cache *cache;
-    struct cache_reader reader;
+    struct realloc_buffer request;      //request to the server, built at once by build_server_request()
+    size_t request_sent;                //number of request bytes already sent
     int header_finished_flag;
+    ssize_t body_received;              //number of response body bytes put into the cache
+    int chunked;                        //response body is in chunked encoding and its end is not received yet
+    int head_request;                   //response to HEAD has no body whatever its headers say
+    int segment_size;                   //size of the next node reserved for the body, grows up to CACHE_SEGMENT_MAX_SIZE
+    struct phr_chunked_decoder chunked_decoder;
+    struct timeval last_active_time;    //time the connection was started or the last response bytes were received
+    size_t bytes_transferred;           //bytes sent and received so far, the proxy limits bytes handled per event by it
+    int response_started;               //some bytes of the response are received
+    struct realloc_buffer chunked_header; //stored header of chunked response, Content-Length is added to it at the end
     struct realloc_buffer header_buffer;
     struct cache_map *cache_map;
 };
@@ -24,11 +44,23 @@ struct server_handler_args {
 
 struct client_handler_args {
     int socket;
-    struct cache_reader reader;
+    struct cache_reader reader;         //reader of the response that is being sent now
+    struct fifo pending_readers;        //pending_reader of pipelined responses, sent in order after the current one
+    int pending_num;                    //readers in pending_readers, at most MAX_PIPELINED_REQUESTS
+    int in_finished;                    //no more requests are going to be read from this client
+    struct timeval last_active_time;    //updated every time request bytes are received or response bytes are sent
+    struct timeval request_start_time;  //time the first byte of the request being received came
+    size_t bytes_transferred;           //bytes sent and received so far, the proxy limits bytes handled per event by it
+    int header_received;                //header of the request being received is parsed, the body is not received
+    size_t body_decoded;                //bytes of the chunked request body decoded in place after its header
+    struct phr_chunked_decoder chunked_decoder;
+    int blocking;                       //sockets are blocking and sending waits for the bytes of the response, 0 by default
     struct cache_map *cache_map;
     struct realloc_buffer request_buffer;
 
-    int (*create_server_handler)(struct server_handler_args *);
+    //is given a server that isn't connected yet, so the proxy decides which thread resolves and connects it
+    int (*create_server_handler)(struct server_handler_args *, void *context);
+    void *context;                      //passed to create_server_handler, the proxy decides what it is
 };
 
 int server_handle_in(struct server_handler_args *args);
@@ -39,12 +71,38 @@ int client_handle_in(struct client_handler_args *args);
 
 int client_handle_out(struct client_handler_args *args);
 
+//returns not 0 if there is a response that should be sent to the client
+int client_has_response(struct client_handler_args *args);
+
+//returns not 0 if the client should be read, it isn't while MAX_PIPELINED_REQUESTS responses are queued
+int client_wants_request(struct client_handler_args *args);
+
+/*
+ * Puts to deadline the time the client should be closed at if nothing happens before,
+ * returns 0 if the client has no deadline, which is the case while it has a response to send.
+ * A request header has to be received in CLIENT_HEADER_TIMEOUT after its first byte,
+ * otherwise the client is closed after CLIENT_IDLE_TIMEOUT without any bytes received or sent.
+ * */
+int client_deadline(struct client_handler_args *args, struct timeval *deadline);
+
+//returns not 0 if the deadline of the client has passed
+int client_timed_out(struct client_handler_args *args, struct timeval *now);
+
+//server has SERVER_FIRST_BYTE_TIMEOUT to start the response and SERVER_RECV_TIMEOUT between the next bytes
+void server_deadline(struct server_handler_args *args, struct timeval *deadline);
+
+int server_timed_out(struct server_handler_args *args, struct timeval *now);
+
 int client_handler_args_init(struct client_handler_args *args, int sockfd,
-                             int (*create_server_handler)(struct server_handler_args *), struct cache_map *cache_map);
+                             int (*create_server_handler)(struct server_handler_args *, void *context),
+                             void *context, struct cache_map *cache_map);
 
 void destroy_client(struct client_handler_args *client);
 
 void destroy_server(struct server_handler_args *server);
 
+//resolves the host of the server and connects to it, may take a while on DNS, returns -1 if it failed
+int server_connect(struct server_handler_args *server, int blocking);
+
 
 #endif //PROXY_HANDLERS_H
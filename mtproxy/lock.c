@@ -0,0 +1,88 @@
+#include "lock.h"
+
+int pthread_ops_mutex_init(pthread_mutex_t *mutex) {
+    return pthread_mutex_init(mutex, NULL);
+}
+
+void pthread_ops_mutex_lock(pthread_mutex_t *mutex) {
+    pthread_mutex_lock(mutex);
+}
+
+void pthread_ops_mutex_unlock(pthread_mutex_t *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+void pthread_ops_mutex_destroy(pthread_mutex_t *mutex) {
+    pthread_mutex_destroy(mutex);
+}
+
+int pthread_ops_cond_init(pthread_cond_t *cond) {
+    return pthread_cond_init(cond, NULL);
+}
+
+void pthread_ops_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    pthread_cond_wait(cond, mutex);
+}
+
+void pthread_ops_cond_signal(pthread_cond_t *cond) {
+    pthread_cond_signal(cond);
+}
+
+void pthread_ops_cond_broadcast(pthread_cond_t *cond) {
+    pthread_cond_broadcast(cond);
+}
+
+void pthread_ops_cond_destroy(pthread_cond_t *cond) {
+    pthread_cond_destroy(cond);
+}
+
+int no_ops_mutex_init(pthread_mutex_t *mutex) {
+    (void) mutex;
+    return 0;
+}
+
+void no_ops_mutex(pthread_mutex_t *mutex) {
+    (void) mutex;
+}
+
+int no_ops_cond_init(pthread_cond_t *cond) {
+    (void) cond;
+    return 0;
+}
+
+//there is no other thread to wake the waiting one
+void no_ops_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    (void) cond;
+    (void) mutex;
+    assert(0);
+}
+
+void no_ops_cond(pthread_cond_t *cond) {
+    (void) cond;
+}
+
+const struct lock_ops pthread_lock_ops = {
+    pthread_ops_mutex_init,
+    pthread_ops_mutex_lock,
+    pthread_ops_mutex_unlock,
+    pthread_ops_mutex_destroy,
+    pthread_ops_cond_init,
+    pthread_ops_cond_wait,
+    pthread_ops_cond_signal,
+    pthread_ops_cond_broadcast,
+    pthread_ops_cond_destroy
+};
+
+const struct lock_ops no_lock_ops = {
+    no_ops_mutex_init,
+    no_ops_mutex,
+    no_ops_mutex,
+    no_ops_mutex,
+    no_ops_cond_init,
+    no_ops_cond_wait,
+    no_ops_cond,
+    no_ops_cond,
+    no_ops_cond
+};
+
+const struct lock_ops *lock_ops = &no_lock_ops;
@@ -0,0 +1,42 @@
+/*
+ * Locking of the modules shared by the engines goes through the lock operations of the running engine.
+ * Threaded engines use pthread operations, operations of the single threaded engine do nothing,
+ * so it doesn't pay for the locks it doesn't need. Waiting on a condition is never done by single threaded engine.
+ * */
+#ifndef PROXY_LOCK_H
+#define PROXY_LOCK_H
+
+#include "consts.h"
+
+struct lock_ops {
+    int (*mutex_init)(pthread_mutex_t *mutex);
+    void (*mutex_lock)(pthread_mutex_t *mutex);
+    void (*mutex_unlock)(pthread_mutex_t *mutex);
+    void (*mutex_destroy)(pthread_mutex_t *mutex);
+    int (*cond_init)(pthread_cond_t *cond);
+    void (*cond_wait)(pthread_cond_t *cond, pthread_mutex_t *mutex);
+    void (*cond_signal)(pthread_cond_t *cond);
+    void (*cond_broadcast)(pthread_cond_t *cond);
+    void (*cond_destroy)(pthread_cond_t *cond);
+};
+
+extern const struct lock_ops pthread_lock_ops;
+extern const struct lock_ops no_lock_ops;
+
+//operations of the running engine, set before anything is locked
+extern const struct lock_ops *lock_ops;
+
+#define MUTEX_INIT(mutex) lock_ops->mutex_init(mutex)
+#define MUTEX_LOCK(mutex) lock_ops->mutex_lock(mutex)
+#define MUTEX_UNLOCK(mutex) lock_ops->mutex_unlock(mutex)
+#define MUTEX_DESTROY(mutex) lock_ops->mutex_destroy(mutex)
+#define COND_INIT(cond) lock_ops->cond_init(cond)
+#define COND_WAIT(cond, mutex) lock_ops->cond_wait((cond), (mutex))
+#define COND_SIGNAL(cond) lock_ops->cond_signal(cond)
+#define COND_BROADCAST(cond) lock_ops->cond_broadcast(cond)
+#define COND_DESTROY(cond) lock_ops->cond_destroy(cond)
+
+//1 if the running engine has more than one thread
+#define LOCKS_ENABLED (lock_ops != &no_lock_ops)
+
+#endif //PROXY_LOCK_H
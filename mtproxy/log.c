@@ -0,0 +1,267 @@
+#include "log.h"
+#include "realloc_buffer.h"
+#include <stdarg.h>
+#include <time.h>
+
+#define LOG_RECORD_MESSAGE 0
+#define LOG_RECORD_ACCESS 1
+
+struct log_record_header {
+    uint16_t len;                               //length of the payload following the header
+    uint8_t type;
+    uint8_t level;
+    struct timeval time;
+};
+
+/*
+ * Single producer single consumer ring: head is moved only by the thread owning the ring,
+ * tail is moved only by the writer. Positions grow infinitely and are wrapped by LOG_RING_SIZE mask.
+ * */
+struct log_ring {
+    char buffer[LOG_RING_SIZE];
+    size_t head;
+    size_t tail;
+    unsigned long dropped;                      //number of messages that didn't fit to the ring
+    unsigned long reported_dropped;             //number of dropped messages the writer already reported
+    int orphaned;                               //owner thread exited, the ring is freed as soon as it is drained
+    struct log_ring *next;
+};
+
+int log_level = LOG_LEVEL_INFO;
+static char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+static int access_log_fd = -1;
+static struct log_ring *rings = NULL;
+static __thread struct log_ring *thread_ring = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+void orphan_ring(void *arg) {
+    __atomic_store_n(&((struct log_ring *) arg)->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+void create_ring_key() {
+    pthread_key_create(&ring_key, orphan_ring);
+}
+
+struct log_ring *get_thread_ring() {
+    struct log_ring *ring = thread_ring;
+    if (ring != NULL) return ring;
+    ring = (struct log_ring *) calloc(1, sizeof(struct log_ring));
+    if (ring == NULL) return NULL;
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+    MUTEX_LOCK(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    MUTEX_UNLOCK(&rings_mutex);
+    thread_ring = ring;
+    return ring;
+}
+
+void ring_copy_in(struct log_ring *ring, size_t position, const void *bytes, size_t len) {
+    size_t offset = position & (LOG_RING_SIZE - 1);
+    size_t first_len = (len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset);
+    memcpy(ring->buffer + offset, bytes, first_len);
+    memcpy(ring->buffer, (const char *) bytes + first_len, len - first_len);
+}
+
+void ring_copy_out(struct log_ring *ring, size_t position, void *bytes, size_t len) {
+    size_t offset = position & (LOG_RING_SIZE - 1);
+    size_t first_len = (len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset);
+    memcpy(bytes, ring->buffer + offset, first_len);
+    memcpy((char *) bytes + first_len, ring->buffer, len - first_len);
+}
+
+void ring_put(struct log_ring *ring, struct log_record_header *header, const void *payload) {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t len = sizeof(struct log_record_header) + header->len;
+    if (LOG_RING_SIZE - (ring->head - tail) < len) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring_copy_in(ring, ring->head, header, sizeof(struct log_record_header));
+    ring_copy_in(ring, ring->head + sizeof(struct log_record_header), payload, header->len);
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+void log_write(int level, const char *format, ...) {
+    char message[LOG_MESSAGE_MAX_LEN];
+    struct log_record_header header;
+    struct log_ring *ring = get_thread_ring();
+    va_list args;
+    int len;
+    if (ring == NULL) return;
+    va_start(args, format);
+    len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (len < 0) return;
+    if (len >= (int) sizeof(message)) len = sizeof(message) - 1;
+    header.len = len;
+    header.type = LOG_RECORD_MESSAGE;
+    header.level = level;
+    gettimeofday(&header.time, NULL);
+    ring_put(ring, &header, message);
+}
+
+void log_access(char *key, int key_len, int cache_hit) {
+    char payload[sizeof(struct access_log_record) + CACHE_KEY_MAX_SIZE];
+    struct access_log_record *record = (struct access_log_record *) payload;
+    struct log_record_header header;
+    struct log_ring *ring;
+    if (access_log_fd < 0) return;
+    ring = get_thread_ring();
+    if (ring == NULL) return;
+    if (key_len > CACHE_KEY_MAX_SIZE) key_len = CACHE_KEY_MAX_SIZE;
+    gettimeofday(&header.time, NULL);
+    record->time_usec = (int64_t) header.time.tv_sec * 1000000 + header.time.tv_usec;
+    record->cache_hit = cache_hit;
+    record->key_len = key_len;
+    memcpy(payload + sizeof(struct access_log_record), key, key_len);
+    header.len = sizeof(struct access_log_record) + key_len;
+    header.type = LOG_RECORD_ACCESS;
+    header.level = LOG_LEVEL_INFO;
+    ring_put(ring, &header, payload);
+}
+
+void format_message(struct realloc_buffer *messages, struct log_record_header *header, char *message) {
+    char prefix[64];
+    struct tm tm;
+    int len;
+    localtime_r(&header->time.tv_sec, &tm);
+    len = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm);
+    len += snprintf(prefix + len, sizeof(prefix) - len, ".%06ld %-5s ", (long) header->time.tv_usec,
+                    level_names[header->level]);
+    realloc_buffer_add_bytes(messages, prefix, len);
+    realloc_buffer_add_bytes(messages, message, header->len);
+    if (header->len == 0 || message[header->len - 1] != '\n') {
+        realloc_buffer_add_bytes(messages, "\n", 1);
+    }
+}
+
+//moves records of the ring to the buffers, returns number of drained bytes
+size_t drain_ring(struct log_ring *ring, struct realloc_buffer *messages, struct realloc_buffer *access) {
+    char payload[sizeof(struct access_log_record) + CACHE_KEY_MAX_SIZE];
+    struct log_record_header header;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = ring->tail, start = tail;
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+    while (tail != head) {
+        ring_copy_out(ring, tail, &header, sizeof(struct log_record_header));
+        ring_copy_out(ring, tail + sizeof(struct log_record_header), payload, header.len);
+        tail += sizeof(struct log_record_header) + header.len;
+        if (header.type == LOG_RECORD_MESSAGE) {
+            format_message(messages, &header, payload);
+        } else {
+            realloc_buffer_add_bytes(access, payload, header.len);
+        }
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if (dropped != ring->reported_dropped) {
+        char report[64];
+        int len = snprintf(report, sizeof(report), "%lu log messages dropped\n", dropped - ring->reported_dropped);
+        realloc_buffer_add_bytes(messages, report, len);
+        ring->reported_dropped = dropped;
+    }
+    return tail - start;
+}
+
+void write_all(int fd, char *bytes, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, bytes, len);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        bytes += res;
+        len -= res;
+    }
+}
+
+size_t log_drain() {
+    struct realloc_buffer messages, access;
+    struct log_ring **ring_ptr;
+    size_t drained = 0;
+    realloc_buffer_init(&messages);
+    realloc_buffer_init(&access);
+    MUTEX_LOCK(&rings_mutex);
+    ring_ptr = &rings;
+    while (*ring_ptr != NULL) {
+        struct log_ring *ring = *ring_ptr;
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        drained += drain_ring(ring, &messages, &access);
+        if (orphaned) {
+            *ring_ptr = ring->next;
+            free(ring);
+        } else {
+            ring_ptr = &ring->next;
+        }
+    }
+    MUTEX_UNLOCK(&rings_mutex);
+    write_all(STDERR_FILENO, messages.buffer, messages.data_len);
+    if (access_log_fd >= 0) {
+        write_all(access_log_fd, access.buffer, access.data_len);
+    }
+    realloc_buffer_destroy(&messages);
+    realloc_buffer_destroy(&access);
+    return drained;
+}
+
+void log_flush() {
+    log_drain();
+}
+
+void *log_writer_method(void *arg) {
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL * 1000000L};
+    (void) arg;
+    while (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        if (log_drain() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_init(int start_writer) {
+    char *level = getenv(LOG_LEVEL_ENV);
+    char *access_log = getenv(ACCESS_LOG_ENV);
+    int i;
+    if (level != NULL) {
+        for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG && strcasecmp(level, level_names[i]) != 0; i++);
+        if (i > LOG_LEVEL_DEBUG) {
+            fprintf(stderr, "Unknown log level %s, should be one of error, warn, info, debug\n", level);
+            return -1;
+        }
+        log_level = i;
+    }
+    if (access_log != NULL) {
+        access_log_fd = open(access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (access_log_fd < 0) {
+            fprintf(stderr, "Couldn't open access log %s: %s\n", access_log, strerror(errno));
+            return -1;
+        }
+    }
+    if (!start_writer) return 0;
+    writer_running = 1;
+    if ((i = pthread_create(&writer_thread, NULL, log_writer_method, NULL)) != 0) {
+        fprintf(stderr, "Couldn't create log writer thread: %s\n", strerror(i));
+        writer_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void log_shutdown() {
+    if (writer_running) {
+        __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+        pthread_join(writer_thread, NULL);
+    }
+    log_drain();
+    if (access_log_fd >= 0) {
+        close(access_log_fd);
+        access_log_fd = -1;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * Logging that doesn't block the proxy.
+ * Every thread writes its messages to its own ring buffer without locks,
+ * background writer thread drains the rings to stderr and to the access log.
+ * Single threaded engine has no writer thread, the ring is drained by log_flush() between polls.
+ *
+ * Messages above LOG_LEVEL_MAX are not compiled at all, messages above log_level are not formatted.
+ * If the ring of a thread is full, its messages are dropped, the writer reports how many.
+ * */
+#ifndef PROXY_LOG_H
+#define PROXY_LOG_H
+
+#include "consts.h"
+#include "lock.h"
+#include <stdint.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif //LOG_LEVEL_MAX
+
+#define LOG_LEVEL_ENV "PROXY_LOG_LEVEL"     //error, warn, info or debug, info if not set
+#define ACCESS_LOG_ENV "PROXY_ACCESS_LOG"   //path to the binary access log, no access log if not set
+
+#define LOG_RING_SIZE (64 * 1024)           //must be a power of two
+#define LOG_MESSAGE_MAX_LEN 1024
+#define LOG_FLUSH_INTERVAL 50               //milliseconds the writer sleeps when all rings are empty
+
+/*
+ * Access log is a sequence of these records, in host byte order.
+ * Each record is followed by key_len bytes of the cache key (host + path) without terminating zero.
+ * */
+struct access_log_record {
+    int64_t time_usec;                      //time the request was received, microseconds since the epoch
+    int32_t cache_hit;                      //1 if the response was found in the cache
+    int32_t key_len;
+};
+
+extern int log_level;
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+
+#define LOG(level, ...) do { if (LOG_ENABLED(level)) log_write((level), __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+//reads log level and access log path from the environment, starts the writer thread if start_writer is not 0
+int log_init(int start_writer);
+
+//formats the message and puts it to the ring of the calling thread, newline is added by the writer
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void log_access(char *key, int key_len, int cache_hit);
+
+//writes everything from the rings, used by single threaded engine instead of the writer thread
+void log_flush();
+
+//stops the writer thread and flushes the rest of the messages
+void log_shutdown();
+
+#endif //PROXY_LOG_H
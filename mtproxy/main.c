@@ -0,0 +1,180 @@
+#include "consts.h"
+#include "engine.h"
+#include "eventloop.h"
+#include "affinity.h"
+#include "log.h"
+#include <limits.h>
+
+short running = 1;
+struct cache_map map = CACHE_MAP_INITIALIZER;
+
+struct engine *engines[] = {&singlethread_engine, &threadpool_engine, &multireactor_engine, &multithread_engine, NULL};
+static char *backend_names[] = {"poll", "epoll", "io_uring"};      //indexed by EVENT_LOOP_* backends
+
+int handle_args(int argc, char *argv[], struct engine **engine, struct proxy_config *config);
+
+int main(int argc, char *argv[]) {
+    struct engine *engine;
+    struct proxy_config config;
+    int res;
+
+    if (handle_args(argc, argv, &engine, &config) < 0)
+        pthread_exit((void *) EXIT_FAILURE);
+    //nothing is locked before the engine is chosen
+    lock_ops = engine->lock_ops;
+    map.max_size = config.cache_map_size;
+    if (log_init(LOCKS_ENABLED) < 0)
+        pthread_exit((void *) EXIT_FAILURE);
+    if (config.pin_threads && affinity_init() < 0) {
+        LOG_WARN("Couldn't get the CPUs to pin threads to, threads are not pinned");
+        config.pin_threads = 0;
+    }
+    //every engine stops when running is reset and finishes its connections
+    if (init_sigint_handler() < 0) {
+        LOG_WARN("Couldn't set SIGINT handler: %s", strerror(errno));
+    }
+    LOG_INFO("Starting %s engine", engine->name);
+    res = engine->run(&config);
+    cache_map_destroy(&map);
+    log_shutdown();
+    if (res < 0)
+        pthread_exit((void *) EXIT_FAILURE);
+    pthread_exit((void *) NULL);
+}
+
+void sigint_handler(int signum) {
+    (void) signum;
+    running = 0;
+}
+
+//without SA_RESTART a blocking accept() or wait returns EINTR, so the engine sees that running is reset
+int init_sigint_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigint_handler;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGINT, &action, NULL);
+}
+
+void print_usage(char *name) {
+    fprintf(stderr, "Usage: %s [-e engine] [-t threads] [-m max_threads] [-c cache_size] [-b backend] [-a address] [-p] listen_port\n"
+                    "  -e  singlethread (default), threadpool, multireactor or multithread\n"
+                    "  -t  worker threads of threadpool, %d by default, or reactors of multireactor, one per CPU by default\n"
+                    "  -m  max worker threads of threadpool, it grows while workers are blocked, %d by default\n"
+                    "  -c  max number of cached responses, %d by default\n"
+                    "  -b  event loop backend: poll, epoll or io_uring, %s by default\n"
+                    "  -a  IPv4 address to listen on, any address by default\n"
+                    "  -p  pin worker threads or reactors to CPUs, NUMA node by node\n",
+            name, DEFAULT_THREAD_NUM, DEFAULT_MAX_THREAD_NUM, DEFAULT_CACHE_MAP_SIZE, backend_names[EVENT_LOOP_BACKEND]);
+}
+
+int parse_positive(char *str, int *value) {
+    char *end;
+    long res;
+    errno = 0;
+    res = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || res <= 0 || res > INT_MAX) return -1;
+    *value = (int) res;
+    return 0;
+}
+
+int handle_args(int argc, char *argv[], struct engine **engine, struct proxy_config *config) {
+    int opt, i, listen_port;
+    *engine = &singlethread_engine;
+    config->thread_num = 0;
+    config->max_thread_num = 0;
+    config->cache_map_size = DEFAULT_CACHE_MAP_SIZE;
+    config->backend = EVENT_LOOP_BACKEND;
+    config->pin_threads = 0;
+    memset(&config->listen_addr, 0, sizeof(struct sockaddr_in));
+    config->listen_addr.sin_family = AF_INET;
+    config->listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    while ((opt = getopt(argc, argv, "e:t:m:c:b:a:p")) != -1) {
+        switch (opt) {
+            case 'e':
+                for (i = 0; engines[i] != NULL && strcmp(optarg, engines[i]->name) != 0; i++);
+                if (engines[i] == NULL) {
+                    fprintf(stderr, "Unknown engine %s\n", optarg);
+                    return -1;
+                }
+                *engine = engines[i];
+                break;
+            case 't':
+                if (parse_positive(optarg, &config->thread_num) < 0) {
+                    fprintf(stderr, "Number of threads should be positive\n");
+                    return -1;
+                }
+                break;
+            case 'm':
+                if (parse_positive(optarg, &config->max_thread_num) < 0) {
+                    fprintf(stderr, "Max number of threads should be positive\n");
+                    return -1;
+                }
+                break;
+            case 'c':
+                if (parse_positive(optarg, &config->cache_map_size) < 0) {
+                    fprintf(stderr, "Cache size should be positive\n");
+                    return -1;
+                }
+                break;
+            case 'b':
+                for (i = EVENT_LOOP_POLL; i <= EVENT_LOOP_IO_URING && strcmp(optarg, backend_names[i]) != 0; i++);
+                if (i > EVENT_LOOP_IO_URING) {
+                    fprintf(stderr, "Unknown event loop backend %s\n", optarg);
+                    return -1;
+                }
+                config->backend = i;
+                break;
+            case 'a':
+                if (inet_pton(AF_INET, optarg, &config->listen_addr.sin_addr) != 1) {
+                    fprintf(stderr, "%s is not a valid IPv4 address\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'p':
+                config->pin_threads = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (parse_positive(argv[optind], &listen_port) < 0 || listen_port > 65535) {
+        fprintf(stderr, "listen_port should be a valid port\n");
+        return -1;
+    }
+    config->listen_addr.sin_port = htons(listen_port);
+    return 0;
+}
+
+int init_listening_socket(struct sockaddr_in *my_addr, int type_flags, int reuse_port) {
+    int enable = 1;
+    int listen_socket = socket(AF_INET, SOCK_STREAM | type_flags, 0);
+    if (listen_socket == -1) {
+        LOG_ERROR("Error: socket() failed with %s", strerror(errno));
+        return -1;
+    }
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+        LOG_ERROR("setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+    }
+    if (reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        LOG_ERROR("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        close(listen_socket);
+        return -1;
+    }
+    if (bind(listen_socket, (struct sockaddr *) my_addr, sizeof(*my_addr))) {
+        LOG_ERROR("Error: bind() failed with %s", strerror(errno));
+        close(listen_socket);
+        return -1;
+    }
+    if (listen(listen_socket, BACKLOG)) {
+        LOG_ERROR("Error: listen() failed with %s", strerror(errno));
+        close(listen_socket);
+        return -1;
+    }
+    return listen_socket;
+}
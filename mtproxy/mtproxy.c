@@ -1,31 +1,18 @@
 #include "consts.h"
-#ifdef MULTITHREAD
+#include "engine.h"
 #include "cache.h"
 #include "handlers.h"
+#include "log.h"
 
-short running = 1;
-struct cache_map map = CACHE_MAP_INITIALIZER;
-
-int handle_args(int argc, char *argv[], struct sockaddr_in *my_addr);
-
-int init_listening_socket(int *sockfd, struct sockaddr_in *my_addr);
-
-int init_sigint_handler();
-
-int run_server_handler_thread(struct server_handler_args *args);
+int run_server_handler_thread(struct server_handler_args *args, void *context);
 
 void *listen_client_thread(void *arg);
 
 void handle_new_connection(int sockfd);
 
-int main(int argc, char *argv[]) {
-    struct sockaddr_in my_addr;
-    int listen_socket;
-
-    if (handle_args(argc, argv, &my_addr) < 0 ||
-        init_listening_socket(&listen_socket, &my_addr) < 0)
-        pthread_exit((void *) EXIT_FAILURE);
-    init_sigint_handler();
+int run_multithread_engine(struct proxy_config *config) {
+    int listen_socket = init_listening_socket(&config->listen_addr, SOCK_CLOEXEC, 0);
+    if (listen_socket < 0) return -1;
 
     while (running) {
         int new_socket;
@@ -37,67 +24,21 @@ int main(int argc, char *argv[]) {
         if (new_socket == -1) {
             if (errno == EINTR)
                 continue;
-            fprintf(stderr, "Accept failed with: %s\n", strerror(errno));
+            LOG_ERROR("Accept failed with: %s", strerror(errno));
             break;
         }
         handle_new_connection(new_socket);
     }
-    printf("running = %d, exiting\n", running);
+    LOG_DEBUG("running = %d, exiting", running);
     sleep(1);
     if (close(listen_socket) != 0)
-        perror("Couldn't close listen socket: ");
+        LOG_ERROR("Couldn't close listen socket: %s", strerror(errno));
     else
-        puts("Listen socket is closed");
-    cache_map_destroy(&map);
-    pthread_exit((void *) NULL);
-}
-
-void sigint_handler(int signum) { running = 0; }
-
-int init_sigint_handler() {
-    signal(SIGINT, sigint_handler);
+        LOG_INFO("Listen socket is closed");
     return 0;
 }
 
-int handle_args(int argc, char *argv[], struct sockaddr_in *my_addr) {
-    int listen_port;
-    if (argc == 1) {
-        fprintf(stderr, "Usage: %s listen_port\n", argv[0]);
-        return -1;
-    }
-    listen_port = atoi(argv[1]);
-    if (listen_port <= 0) {
-        fprintf(stderr, "listen_port should be a valid port\n");
-        return -1;
-    }
-    memset(my_addr, 0, sizeof(struct sockaddr_in));
-    my_addr->sin_family = AF_INET;
-    my_addr->sin_addr.s_addr = htonl(INADDR_ANY);
-    my_addr->sin_port = htons(listen_port);
-    return 0;
-}
-
-int init_listening_socket(int *sockfd, struct sockaddr_in *my_addr) {
-    int enable = 1;
-    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_socket == -1) {
-        fprintf(stderr, "Error: socket() failed with %s\n", strerror(errno));
-        return -1;
-    }
-    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
-    }
-    if (bind(listen_socket, (struct sockaddr *) my_addr, sizeof(*my_addr))) {
-        fprintf(stderr, "Error: bind() failed with %s\n", strerror(errno));
-        return -1;
-    }
-    if (listen(listen_socket, BACKLOG)) {
-        fprintf(stderr, "Error: listen() failed with %s\n", strerror(errno));
-        return -1;
-    }
-    *sockfd = listen_socket;
-    return 0;
-}
+struct engine multithread_engine = {"multithread", &pthread_lock_ops, run_multithread_engine};
 
 int create_detached_thread(void *(*func)(void *), void *arg) {
     int res;
@@ -105,10 +46,10 @@ int create_detached_thread(void *(*func)(void *), void *arg) {
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    res = pthread_create(&thread, NULL, func, arg);
+    res = pthread_create(&thread, &attr, func, arg);
     pthread_attr_destroy(&attr);
-    if (res < 0) {
-        fprintf(stderr, "Couldn't create new thread: %s\n", res);
+    if (res != 0) {
+        LOG_ERROR("Couldn't create new thread: %s", strerror(res));
         return -1;
     }
     return 0;
@@ -116,67 +57,93 @@ int create_detached_thread(void *(*func)(void *), void *arg) {
 
 void *server_thread(void *_arg) {
     struct server_handler_args *arg = (struct server_handler_args *) _arg;
-    int res = HANDLER_CONTINUE;
-    printf("Starting sending request to server\n");
+    //server is connected by its own thread, so the client thread doesn't wait for DNS
+    int res = (server_connect(arg, 1) < 0 ? HANDLER_ERROR : HANDLER_CONTINUE);
+    struct timeval now, timeout = {SERVER_RECV_TIMEOUT, 0};
+    //recv() returns at least every timeout seconds, so the deadline of the server is checked
+    if (SERVER_FIRST_BYTE_TIMEOUT < SERVER_RECV_TIMEOUT) timeout.tv_sec = SERVER_FIRST_BYTE_TIMEOUT;
+    if (res != HANDLER_ERROR && setsockopt(arg->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        LOG_ERROR("setsockopt(SO_RCVTIMEO) failed: %s", strerror(errno));
+    }
+    LOG_DEBUG("Starting sending request to server");
     while (running && res != HANDLER_ERROR) {
-        puts("t");
         res = server_handle_out(arg);
         if (res == HANDLER_FINISHED) break;
-        if (res == HANDLER_CONTINUE || res == HANDLER_EINTR) continue;
-        fprintf(stderr, "Error while sending data to server: %s\n", strerror(errno));
+        if (res == HANDLER_CONTINUE || res == HANDLER_WOULDBLOCK || res == HANDLER_EINTR) continue;
+        LOG_ERROR("Error while sending data to server: %s", strerror(errno));
     }
-    puts("Sending request to server finished");
+    LOG_DEBUG("Sending request to server finished");
     while (running && res != HANDLER_ERROR) {
         res = server_handle_in(arg);
         if (res == HANDLER_FINISHED) break;
-        if (res == HANDLER_CONTINUE || res == HANDLER_EINTR) continue;
-        fprintf(stderr, "Error while receiving data from server: %s\n", strerror(errno));
+        gettimeofday(&now, NULL);
+        //recv() timeout is reported as HANDLER_WOULDBLOCK
+        if (res == HANDLER_WOULDBLOCK && server_timed_out(arg, &now)) {
+            LOG_WARN("Server timed out: %s", arg->cache->key);
+            break;
+        }
+        if (res == HANDLER_CONTINUE || res == HANDLER_WOULDBLOCK || res == HANDLER_EINTR) continue;
+        LOG_ERROR("Error while receiving data from server: %s", strerror(errno));
     }
-    printf("Finished receiving data from server %s\n", arg->cache->key);
+    LOG_DEBUG("Finished receiving data from server %s", arg->cache->key);
     destroy_server(arg);
     pthread_exit(NULL);
 }
 
 void *listen_client_thread(void *arg) {
-    int res = 0;
-    int sockfd = (int) arg;
+    int in_res, out_res = HANDLER_CONTINUE;
+    int sockfd = (int) (intptr_t) arg;
     struct client_handler_args args;
-    client_handler_args_init(&args, sockfd, run_server_handler_thread, &map);
-    printf("Starting receiving request from client: %d\n", sockfd);
-    while (running && res != HANDLER_ERROR) {
-        res = client_handle_in(&args);
-        if (res == HANDLER_FINISHED) break;
-        if (res == HANDLER_CONTINUE || res == HANDLER_EINTR) continue;
-        fprintf(stderr, "Error while receiving data from client: %s\n", strerror(errno));
+    struct timeval now, timeout = {CLIENT_HEADER_TIMEOUT, 0};
+    client_handler_args_init(&args, sockfd, run_server_handler_thread, NULL, &map);
+    args.blocking = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        LOG_ERROR("setsockopt(SO_RCVTIMEO) failed: %s", strerror(errno));
     }
-    printf("Finishing receiving request from client, starting sending data to client: %d\n", sockfd);
-    while (running && res != HANDLER_ERROR) {
-        res = client_handle_out(&args);
-        if (res == HANDLER_FINISHED) break;
-        if (res == HANDLER_CONTINUE || res == HANDLER_EINTR) continue;
-        fprintf(stderr, "Error while sending data to client: %s\n", strerror(errno));
+    LOG_DEBUG("Starting receiving requests from client: %d", sockfd);
+    while (running) {
+        in_res = client_handle_in(&args);
+        if (in_res == HANDLER_ERROR) {
+            LOG_ERROR("Error while receiving data from client: %s", strerror(errno));
+            break;
+        }
+        out_res = HANDLER_CONTINUE;
+        while (running && client_has_response(&args) && out_res != HANDLER_ERROR && out_res != HANDLER_FINISHED) {
+            out_res = client_handle_out(&args);
+        }
+        if (out_res == HANDLER_ERROR) {
+            LOG_ERROR("Error while sending data to client: %s", strerror(errno));
+            break;
+        }
+        if (out_res == HANDLER_FINISHED || (in_res == HANDLER_FINISHED && !client_has_response(&args))) break;
+        gettimeofday(&now, NULL);
+        if ((in_res == HANDLER_CONTINUE || in_res == HANDLER_WOULDBLOCK) && client_timed_out(&args, &now)) {
+            LOG_DEBUG("Closing timed out client connection");
+            break;
+        }
     }
-    printf("Finished sending data to client: %d\n", sockfd);
+    LOG_DEBUG("Finished sending data to client: %d", sockfd);
     destroy_client(&args);
     pthread_exit(NULL);
 }
 
-int run_server_handler_thread(struct server_handler_args *args) {
+int run_server_handler_thread(struct server_handler_args *args, void *context) {
     int res;
-    puts("Starting new server thread");
+    (void) context;
+    LOG_DEBUG("Starting new server thread");
     res = create_detached_thread(server_thread, (void *) args);
     if (res < 0) {
         destroy_server(args);
+        return -1;
     }
     return 0;
 }
 
 void handle_new_connection(int sockfd) {
     int res;
-    printf("Starting handling new connection\n");
-    res = create_detached_thread(listen_client_thread, (void *) sockfd);
+    LOG_DEBUG("Starting handling new connection");
+    res = create_detached_thread(listen_client_thread, (void *) (intptr_t) sockfd);
     if (res < 0) {
         close(sockfd);
     }
 }
-#endif
\ No newline at end of file
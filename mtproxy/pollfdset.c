@@ -1,4 +1,6 @@
 #include "pollfdset.h"
+#include <limits.h>
+#include <sys/resource.h>
 
 void init_pollfd(struct pollfd *pollfd) {
     pollfd->fd = UNOCCUPIED_DESCRIPTOR;
@@ -6,41 +8,82 @@ void init_pollfd(struct pollfd *pollfd) {
     pollfd->revents = 0;
 }
 
+//every descriptor the process may open can get a pollfd
+int get_max_pollfd_num() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > INT_MAX) {
+        return INT_MAX;
+    }
+    return (int) limit.rlim_cur;
+}
+
+//new pollfds are added to the free list so that the lowest one is allocated first
+int pollfdset_grow(struct pollfdset *set) {
+    int i, size;
+    struct pollfd *fds;
+    void **owners;
+    int *next_free;
+    if (set->size == set->max_size || set->retired_num == POLLFD_SET_MAX_RETIRED) return -1;
+    size = (set->size == 0 ? POLLFD_SET_INITIAL_SIZE : set->size * 2);
+    if (size > set->max_size || size < 0) size = set->max_size;
+    fds = (struct pollfd *) malloc(size * sizeof(struct pollfd));
+    if (fds == NULL) return -1;
+    owners = (void **) realloc(set->owners, size * sizeof(void *));
+    if (owners == NULL) {
+        free(fds);
+        return -1;
+    }
+    set->owners = owners;
+    next_free = (int *) realloc(set->next_free, size * sizeof(int));
+    if (next_free == NULL) {
+        free(fds);
+        return -1;
+    }
+    set->next_free = next_free;
+    if (set->fds != NULL) {
+        memcpy(fds, set->fds, set->size * sizeof(struct pollfd));
+        set->retired[set->retired_num++] = set->fds;
+    }
+    for (i = set->size; i < size; i++) {
+        init_pollfd(fds + i);
+        set->owners[i] = NULL;
+        set->next_free[i] = (i + 1 < size ? i + 1 : -1);
+    }
+    set->first_free = set->size;
+    set->fds = fds;
+    set->size = size;
+    return 0;
+}
+
 int pollfdset_init(struct pollfdset *set) {
-    int i;
-#ifdef THREADPOOL
-    int res = pthread_mutex_init(&set->mutex, NULL);
-    if (res != 0) {
+    if (MUTEX_INIT(&set->mutex) != 0) {
         return -1;
     }
-#endif
-    for (i = 0; i < MAX_POLLFD_NUM; i++)
-        init_pollfd(set->fds + i);
+    set->fds = NULL;
+    set->owners = NULL;
+    set->next_free = NULL;
+    set->size = 0;
+    set->max_size = get_max_pollfd_num();
+    set->first_free = -1;
     set->max_occupied_fd = 0;
-    return 0;
+    set->retired_num = 0;
+    return pollfdset_grow(set);
 }
 
-struct pollfd *allocate_pollfd(struct pollfdset *set, int fd, int events) {
-    int i;
-#ifdef THREADPOOL
-    pthread_mutex_lock(&set->mutex);
-#endif
-    for (i = 0; i < MAX_POLLFD_NUM; i++) {
-        if (i == set->max_occupied_fd)
-            set->max_occupied_fd = i + 1;
-        if (set->fds[i].fd == UNOCCUPIED_DESCRIPTOR) {
-            set->fds[i].fd = fd;
-            set->fds[i].events = events;
-#ifdef THREADPOOL
-            pthread_mutex_unlock(&set->mutex);
-#endif
-            return &set->fds[i];
-        }
+int allocate_pollfd(struct pollfdset *set, int fd, int events, void *owner) {
+    int index = -1;
+    MUTEX_LOCK(&set->mutex);
+    if (set->first_free >= 0 || pollfdset_grow(set) == 0) {
+        index = set->first_free;
+        set->first_free = set->next_free[index];
+        set->fds[index].fd = fd;
+        set->fds[index].events = events;
+        set->fds[index].revents = 0;
+        set->owners[index] = owner;
+        if (index >= set->max_occupied_fd) set->max_occupied_fd = index + 1;
     }
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&set->mutex);
-#endif
-    return NULL;
+    MUTEX_UNLOCK(&set->mutex);
+    return index;
 }
 
 void pollfdset_trim(struct pollfdset *set) {
@@ -49,19 +92,28 @@ void pollfdset_trim(struct pollfdset *set) {
             return;
 }
 
-void free_pollfd(struct pollfdset *set, struct pollfd *pollfd) {
-#ifdef THREADPOOL
-    pthread_mutex_lock(&set->mutex);
-#endif
-    init_pollfd(pollfd);
+void free_pollfd(struct pollfdset *set, int index) {
+    MUTEX_LOCK(&set->mutex);
+    init_pollfd(set->fds + index);
+    set->owners[index] = NULL;
+    set->next_free[index] = set->first_free;
+    set->first_free = index;
     pollfdset_trim(set);
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&set->mutex);
-#endif
+    MUTEX_UNLOCK(&set->mutex);
+}
+
+void pollfdset_release_retired(struct pollfdset *set) {
+    MUTEX_LOCK(&set->mutex);
+    while (set->retired_num > 0) {
+        free(set->retired[--set->retired_num]);
+    }
+    MUTEX_UNLOCK(&set->mutex);
 }
 
 void pollfdset_destroy(struct pollfdset *set) {
-#ifdef THREADPOOL
-    pthread_mutex_destroy(&set->mutex);
-#endif
+    pollfdset_release_retired(set);
+    free(set->fds);
+    free(set->owners);
+    free(set->next_free);
+    MUTEX_DESTROY(&set->mutex);
 }
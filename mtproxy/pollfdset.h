@@ -1,32 +1,50 @@
+/*
+ * Growable array of pollfds that can be passed to poll() as is.
+ * Free pollfds are kept in a free list, so allocating and freeing a pollfd takes O(1).
+ * Pollfds are referred to by their indices, which don't change when the array grows.
+ * The array doubles when it is full, up to the RLIMIT_NOFILE of the process.
+ *
+ * Old array is not freed when the array grows, because poll() running in another thread may still use it,
+ * the thread calls pollfdset_release_retired() after poll() returns.
+ * */
 #ifndef POLLFD_SET
 #define POLLFD_SET
 
 #include "consts.h"
+#include "lock.h"
 
-#ifndef MAX_POLLFD_NUM
-#define MAX_POLLFD_NUM 1020
-#endif //MAX_POLLFD_NUM
+#define POLLFD_SET_INITIAL_SIZE 64
+#define POLLFD_SET_MAX_RETIRED 32           //enough for the array to double until it reaches INT_MAX pollfds
 
 #define UNOCCUPIED_DESCRIPTOR -1
 #define OCCUPIED_DESCRIPTOR -2
 
 struct pollfdset {
-    struct pollfd fds[MAX_POLLFD_NUM];
-    int max_occupied_fd;
-#ifdef THREADPOOL
+    struct pollfd *fds;
+    void **owners;                          //owner of each pollfd, set by allocate_pollfd()
+    int *next_free;                         //next free pollfd in the free list
+    int size;                               //number of pollfds in the array
+    int max_size;
+    int first_free;                         //-1 if every pollfd is occupied
+    int max_occupied_fd;                    //pollfds starting from this one are free
+    struct pollfd *retired[POLLFD_SET_MAX_RETIRED];
+    int retired_num;
     pthread_mutex_t mutex;
-#endif
 };
 
 void init_pollfd(struct pollfd *pollfd);
 
 int pollfdset_init(struct pollfdset *set);
 
-struct pollfd *allocate_pollfd(struct pollfdset *set, int fd, int events);
+//returns the index of the allocated pollfd or -1 if the set can't grow anymore
+int allocate_pollfd(struct pollfdset *set, int fd, int events, void *owner);
 
 void pollfdset_trim(struct pollfdset *set);
 
-void free_pollfd(struct pollfdset *set, struct pollfd *pollfd);
+void free_pollfd(struct pollfdset *set, int index);
+
+//frees the arrays replaced by the grown ones, called when poll() doesn't use them anymore
+void pollfdset_release_retired(struct pollfdset *set);
 
 void pollfdset_destroy(struct pollfdset *set);
-#endif //POLLFD_SET
\ No newline at end of file
+#endif //POLLFD_SET
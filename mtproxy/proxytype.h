@@ -1,9 +0,0 @@
-#ifndef PROXYTYPE_H
-#define PROXYTYPE_H
-
-//#define MULTITHREAD
-#define SINGLETHREAD
-//#define THREADPOOL
-
-//if nothing is defined then it would be single threaded proxy
-#endif //PROXYTYPE_H
@@ -1,11 +1,13 @@
 #include "realloc_buffer.h"
+#include "log.h"
 
 int increase_buffer_size_to_fit_n_more_bytes(struct realloc_buffer *realloc_buffer, int n) {
-    int new_buffer_size = realloc_buffer->data_len + n;
+    size_t new_buffer_size;
     if (n < 0) {
         errno = EINVAL;
         return -1;
     }
+    new_buffer_size = realloc_buffer->data_len + n;
     if (new_buffer_size > realloc_buffer->buffer_size) {
         realloc_buffer->buffer = (char *) realloc(realloc_buffer->buffer, new_buffer_size);
         if (realloc_buffer->buffer == NULL) {
@@ -24,6 +26,10 @@ void realloc_buffer_init(struct realloc_buffer *realloc_buffer) {
     realloc_buffer->buffer_size = 0;
 }
 
+int realloc_buffer_reserve(struct realloc_buffer *realloc_buffer, int n) {
+    return increase_buffer_size_to_fit_n_more_bytes(realloc_buffer, n);
+}
+
 int realloc_buffer_add_bytes(struct realloc_buffer *realloc_buffer, char *bytes, int len) {
     if (increase_buffer_size_to_fit_n_more_bytes(realloc_buffer, len) != 0) {
         return -1;
@@ -39,7 +45,7 @@ int realloc_buffer_recv(int sockfd, struct realloc_buffer *realloc_buffer, int m
     int recv_res;
     char *recv_buffer;
     if (increase_buffer_size_to_fit_n_more_bytes(realloc_buffer, max_len) != 0) {
-        perror("couldn't increase realloc buffer");
+        LOG_ERROR("couldn't increase realloc buffer: %s", strerror(errno));
         return -1;
     }
     recv_buffer = realloc_buffer->buffer + realloc_buffer->data_len;
@@ -69,19 +75,14 @@ int realloc_buffer_send(int sockfd, struct realloc_buffer *realloc_buffer, int o
 int realloc_buffer_remove_bytes_at_start(struct realloc_buffer *realloc_buffer, int n) {
     int new_size = realloc_buffer->data_len - n;
     if (new_size <= 0) {
-        free(realloc_buffer->buffer);
-        realloc_buffer->data_len = realloc_buffer->buffer_size = 0;
-        realloc_buffer->buffer = NULL;
+        if (realloc_buffer->buffer_size > REALLOC_BUFFER_KEEP_SIZE) {
+            realloc_buffer_destroy(realloc_buffer);
+        }
+        realloc_buffer->data_len = 0;
         return 0;
     }
-    char *new_buffer = (char *) malloc(sizeof(char) * new_size);
-    if (new_buffer == NULL) {
-        return -1;
-    }
-    memcpy(new_buffer, realloc_buffer->buffer + n, new_size);
-    free(realloc_buffer->buffer);
-    realloc_buffer->buffer = new_buffer;
-    realloc_buffer->buffer_size = realloc_buffer->data_len = new_size;
+    memmove(realloc_buffer->buffer, realloc_buffer->buffer + n, new_size);
+    realloc_buffer->data_len = new_size;
     return 0;
 }
 
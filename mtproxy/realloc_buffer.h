@@ -3,6 +3,8 @@
 
 #include "consts.h"
 
+#define REALLOC_BUFFER_KEEP_SIZE (2 * CLIENT_RECV_BUFFER_LENGTH)    //emptied buffers up to this size keep their memory
+
 struct realloc_buffer {
     char *buffer;
     size_t data_len;
@@ -12,12 +14,16 @@ struct realloc_buffer {
 
 void realloc_buffer_init(struct realloc_buffer *realloc_buffer);
 
+//makes buffer big enough to add n more bytes without reallocation
+int realloc_buffer_reserve(struct realloc_buffer *realloc_buffer, int n);
+
 int realloc_buffer_add_bytes(struct realloc_buffer *realloc_buffer, char *bytes, int len);
 
 int realloc_buffer_recv(int sockfd, struct realloc_buffer *realloc_buffer, int max_len, int recv_flags);
 
 int realloc_buffer_send(int sockfd, struct realloc_buffer *realloc_buffer, int offset, int max_len, int recv_flags);
 
+//moves the rest of the bytes to the start, the memory is reused by the next bytes unless the buffer has grown big
 int realloc_buffer_remove_bytes_at_start(struct realloc_buffer *realloc_buffer, int n);
 
 void realloc_buffer_destroy(struct realloc_buffer *realloc_buffer);
@@ -0,0 +1,126 @@
+/*
+ * Bounded ring buffers of pointers with a power of two capacity. Slots are allocated once by the init,
+ * pushing and popping allocate nothing and return -1 if the ring is full or empty.
+ *
+ * SPSC ring is for one producer and one consumer thread. Each of them keeps a copy of the position
+ * of the other one and reloads it only when the ring looks full or empty, so the positions
+ * bounce between their caches rarely.
+ * MPSC ring is for any producers and one consumer. Every slot has a sequence number telling
+ * whether it's free for the producer of a position or filled for the consumer, as in the queue
+ * of the thread pool, so producers only race for the enqueue position.
+ * */
+#ifndef PROXY_RING_H
+#define PROXY_RING_H
+
+#include "consts.h"
+#include <stdint.h>
+
+struct spsc_ring {
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));  //next position to pop, moved by the consumer
+    size_t cached_tail;                     //tail as the consumer saw it last time
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  //next position to push, moved by the producer
+    size_t cached_head;                     //head as the producer saw it last time
+    size_t mask __attribute__((aligned(CACHE_LINE_SIZE)));
+    void **values;
+};
+
+struct mpsc_ring_slot {
+    size_t sequence;                        //position the slot is free for, position + 1 when it's filled
+    void *value;
+};
+
+struct mpsc_ring {
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));  //moved by the consumer only
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  //claimed by the producers with CAS
+    size_t mask __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct mpsc_ring_slot *slots;
+};
+
+//capacity must be a power of two, returns -1 if it isn't or the slots can't be allocated
+static inline int spsc_ring_init(struct spsc_ring *ring, size_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) return -1;
+    ring->values = (void **) malloc(sizeof(void *) * capacity);
+    if (ring->values == NULL) return -1;
+    ring->head = ring->cached_tail = ring->tail = ring->cached_head = 0;
+    ring->mask = capacity - 1;
+    return 0;
+}
+
+static inline void spsc_ring_destroy(struct spsc_ring *ring) {
+    free(ring->values);
+    ring->values = NULL;
+}
+
+static inline int spsc_ring_push(struct spsc_ring *ring, void *value) {
+    size_t tail = ring->tail;
+    if (tail - ring->cached_head > ring->mask) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head > ring->mask) return -1;
+    }
+    ring->values[tail & ring->mask] = value;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline int spsc_ring_pop(struct spsc_ring *ring, void **value) {
+    size_t head = ring->head;
+    if (head == ring->cached_tail) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->cached_tail) return -1;
+    }
+    *value = ring->values[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//capacity must be a power of two, returns -1 if it isn't or the slots can't be allocated
+static inline int mpsc_ring_init(struct mpsc_ring *ring, size_t capacity) {
+    size_t i;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) return -1;
+    ring->slots = (struct mpsc_ring_slot *) malloc(sizeof(struct mpsc_ring_slot) * capacity);
+    if (ring->slots == NULL) return -1;
+    for (i = 0; i < capacity; i++) {
+        ring->slots[i].sequence = i;
+    }
+    ring->head = ring->tail = 0;
+    ring->mask = capacity - 1;
+    return 0;
+}
+
+static inline void mpsc_ring_destroy(struct mpsc_ring *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+static inline int mpsc_ring_push(struct mpsc_ring *ring, void *value) {
+    struct mpsc_ring_slot *slot;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    intptr_t diff;
+    for (;;) {
+        slot = ring->slots + (pos & ring->mask);
+        diff = (intptr_t) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->value = value;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//a push that has claimed its slot but hasn't filled it yet is seen as an empty ring
+static inline int mpsc_ring_pop(struct mpsc_ring *ring, void **value) {
+    size_t head = ring->head;
+    struct mpsc_ring_slot *slot = ring->slots + (head & ring->mask);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) return -1;
+    *value = slot->value;
+    __atomic_store_n(&slot->sequence, head + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->head = head + 1;
+    return 0;
+}
+
+#endif //PROXY_RING_H
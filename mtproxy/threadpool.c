@@ -1,136 +1,587 @@
 #include "threadpool.h"
+#include "affinity.h"
+#include "log.h"
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-struct thread_pool_task {
-    void (*task)(void *);
+//timeout is in ms, -1 waits until woken, returns -1 with ETIMEDOUT if the timeout passed
+int futex_wait(unsigned int *addr, unsigned int value, int timeout) {
+    struct timespec time = {timeout / 1000, (timeout % 1000) * 1000000L};
+    return (int) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout < 0 ? NULL : &time, NULL, 0);
+}
+
+void futex_wake(unsigned int *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void count_wait(unsigned long *waits, uint64_t wait) {
+    int bucket = (wait == 0 ? 0 : 64 - __builtin_clzll(wait));
+    waits[bucket < THREAD_POOL_WAIT_BUCKETS ? bucket : THREAD_POOL_WAIT_BUCKETS - 1]++;
+}
+
+/*
+ * Claims positions for up to n tasks with one CAS, returns the number of tasks pushed, 0 if the queue is full.
+ * The last claimed slot being free means that consumers have taken every earlier position of its lap,
+ * so the slots before it are free or are being freed by consumers that are copying their tasks right now.
+ * If the last slot is not free yet, fewer tasks are tried.
+ * */
+int thread_pool_push_tasks(struct thread_pool_queue *queue, struct thread_pool_task *tasks, int n) {
+    struct thread_pool_slot *slot;
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    intptr_t diff;
+    uint64_t now = 0;
+    int i;
+    if (n > THREAD_POOL_QUEUE_SIZE) n = THREAD_POOL_QUEUE_SIZE;
+    for (;;) {
+        slot = queue->slots + ((pos + n - 1) & (THREAD_POOL_QUEUE_SIZE - 1));
+        diff = (intptr_t) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t) (pos + n - 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + n, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            if (n == 1) return 0;
+            n /= 2;
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        slot = queue->slots + ((pos + i) & (THREAD_POOL_QUEUE_SIZE - 1));
+        while (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + i) sched_yield();
+        slot->task = tasks[i].task;
+        slot->args = tasks[i].args;
+        if (((pos + i) & (THREAD_POOL_WAIT_SAMPLE - 1)) == 0 && now == 0) now = now_us();
+        __atomic_store_n(&slot->enqueue_time, ((pos + i) & (THREAD_POOL_WAIT_SAMPLE - 1)) == 0 ? now : 0,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->sequence, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+//returns -1 if the queue is empty, the wait of the task is counted to waits unless it's NULL
+int thread_pool_pop(struct thread_pool_queue *queue, struct thread_pool_task *task, unsigned long *waits) {
+    struct thread_pool_slot *slot;
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    intptr_t diff;
+    for (;;) {
+        slot = queue->slots + (pos & (THREAD_POOL_QUEUE_SIZE - 1));
+        diff = (intptr_t) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    task->task = slot->task;
+    task->args = slot->args;
+    if (waits != NULL && slot->enqueue_time != 0) count_wait(waits, now_us() - slot->enqueue_time);
+    __atomic_store_n(&slot->sequence, pos + THREAD_POOL_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Takes a task from the highest priority lane that has one, or from the lowest one every
+ * THREAD_POOL_STARVATION_INTERVAL looks. Waits are counted to the waits of the worker,
+ * or of the pool if it's the caller of thread_pool_run(), or not at all for other threads.
+ * */
+int pop_global(struct thread_pool *thread_pool, struct thread_pool_worker *worker, struct thread_pool_task *task,
+               unsigned long (*waits)[THREAD_POOL_WAIT_BUCKETS]) {
+    unsigned int tick = (worker != NULL ? worker->lane_tick++ :
+                         __atomic_fetch_add(&thread_pool->lane_tick, 1, __ATOMIC_RELAXED));
+    int i, lane, reversed = (tick % THREAD_POOL_STARVATION_INTERVAL == THREAD_POOL_STARVATION_INTERVAL - 1);
+    for (i = 0; i < THREAD_POOL_PRIORITIES; i++) {
+        lane = (reversed ? THREAD_POOL_PRIORITIES - 1 - i : i);
+        if (thread_pool_pop(thread_pool->queues + lane, task, waits != NULL ? waits[lane] : NULL) == 0) return 0;
+    }
+    return -1;
+}
+
+static __thread struct thread_pool_worker *current_worker = NULL;
+
+//returns -1 if the deque is full, called only by the owner
+int deque_push(struct thread_pool_deque *deque, void (*task)(void *), void *args) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    struct thread_pool_task *slot = deque->tasks + (bottom & (THREAD_POOL_DEQUE_SIZE - 1));
+    if (bottom - top >= THREAD_POOL_DEQUE_SIZE) return -1;
+    __atomic_store_n(&slot->task, task, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->args, args, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//takes the newest task, returns -1 if the deque is empty, called only by the owner
+int deque_pop(struct thread_pool_deque *deque, struct thread_pool_task *task) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    long top;
+    int res = 0;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    *task = deque->tasks[bottom & (THREAD_POOL_DEQUE_SIZE - 1)];
+    if (top == bottom) {
+        //the last task is raced for with thieves
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            res = -1;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return res;
+}
+
+//takes the oldest task, returns -1 if the deque is empty or another thread took the task first
+int deque_steal(struct thread_pool_deque *deque, struct thread_pool_task *task) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long bottom;
+    struct thread_pool_task *slot;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return -1;
+    slot = deque->tasks + (top & (THREAD_POOL_DEQUE_SIZE - 1));
+    task->task = __atomic_load_n(&slot->task, __ATOMIC_RELAXED);
+    task->args = __atomic_load_n(&slot->args, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return -1;
+    return 0;
+}
+
+//changing the epoch makes the workers that read the old one return from futex_wait() at once
+void wake_workers(struct thread_pool *thread_pool, int count) {
+    __atomic_add_fetch(&thread_pool->epoch, 1, __ATOMIC_RELEASE);
+    futex_wake(&thread_pool->epoch, count);
+}
+
+//called after count tasks are pushed, pairs with the registration of a parking worker
+void wake_parked_workers(struct thread_pool *thread_pool, int count) {
+    int parked;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    parked = __atomic_load_n(&thread_pool->parked, __ATOMIC_RELAXED);
+    if (parked > 0) {
+        wake_workers(thread_pool, count < parked ? count : parked);
+    }
+}
+
+unsigned int next_random(unsigned int *seed) {
+    unsigned int x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+//looks at the deques of the other workers starting from a random one, thief is NULL if it's not a worker
+int steal_task(struct thread_pool *thread_pool, struct thread_pool_worker *thief, struct thread_pool_task *task) {
+    int i, start, worker_num = __atomic_load_n(&thread_pool->worker_num, __ATOMIC_ACQUIRE);
+    struct thread_pool_worker *victim;
+    if (worker_num == 0) return -1;
+    start = (thief == NULL ? 0 : (int) (next_random(&thief->seed) % worker_num));
+    for (i = 0; i < worker_num; i++) {
+        victim = __atomic_load_n(thread_pool->workers + (start + i) % worker_num, __ATOMIC_ACQUIRE);
+        if (victim != NULL && victim != thief && deque_steal(&victim->deque, task) == 0) return 0;
+    }
+    return -1;
+}
+
+/*
+ * Own deque goes first, then the global queue and then the other workers. Every THREAD_POOL_GLOBAL_INTERVAL tasks
+ * the global queue is looked at first, so that tasks spawning local tasks don't starve it.
+ * */
+int next_task(struct thread_pool *thread_pool, struct thread_pool_worker *worker, struct thread_pool_task *task) {
+    if (worker == NULL) return pop_global(thread_pool, NULL, task, thread_pool->waits);
+    if (++worker->tick % THREAD_POOL_GLOBAL_INTERVAL == 0 && pop_global(thread_pool, worker, task, worker->waits) == 0) {
+        return 0;
+    }
+    if (deque_pop(&worker->deque, task) == 0) return 0;
+    if (pop_global(thread_pool, worker, task, worker->waits) == 0) return 0;
+    return steal_task(thread_pool, worker, task);
+}
+
+void run_task(struct thread_pool_worker *worker, struct thread_pool_task *task) {
+    if (worker != NULL) __atomic_store_n(&worker->task_seq, worker->task_seq + 1, __ATOMIC_RELAXED);
+    task->task(task->args);
+    if (worker != NULL) __atomic_store_n(&worker->task_seq, worker->task_seq + 1, __ATOMIC_RELAXED);
+}
+
+//lowers the number of running workers unless it's the minimum already, returns 1 if the worker may exit
+int retire_worker(struct thread_pool *thread_pool) {
+    int thread_num = __atomic_load_n(&thread_pool->thread_num, __ATOMIC_RELAXED);
+    while (thread_num > thread_pool->min_thread_num) {
+        if (__atomic_compare_exchange_n(&thread_pool->thread_num, &thread_num, thread_num - 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return 1;
+    }
+    return 0;
+}
 
-    void *args;
-};
+/*
+ * Worker that finds no task yields THREAD_POOL_SPINS times before parking, a task usually comes sooner
+ * than a futex wake up would take. Worker registers as parked before the last look for a task, and a producer
+ * looks for parked workers after its push, so either the worker sees the task or the producer sees the worker.
+ * Workers wait for the tasks until the pool is shut down, the caller of thread_pool_run() (worker is NULL)
+ * returns when the queue is empty.
+ * Worker of an adaptive pool parks for THREAD_POOL_IDLE_TIMEOUT at most. If it retires, it looks for a task
+ * once more after it's no longer counted as parked, a wake up meant for it might have been lost on its timeout.
+ * */
+void run_tasks(struct thread_pool *thread_pool, struct thread_pool_worker *worker) {
+    struct thread_pool_task task;
+    unsigned int epoch;
+    int spins = 0, res;
+    int timeout = (thread_pool->max_thread_num > thread_pool->min_thread_num ? THREAD_POOL_IDLE_TIMEOUT : -1);
+    for (;;) {
+        if (next_task(thread_pool, worker, &task) == 0) {
+            spins = 0;
+            run_task(worker, &task);
+            continue;
+        }
+        if (worker == NULL) return;
+        if (spins++ < THREAD_POOL_SPINS && !__atomic_load_n(&thread_pool->shut_down, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+            continue;
+        }
+        spins = 0;
+        epoch = __atomic_load_n(&thread_pool->epoch, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&thread_pool->parked, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (next_task(thread_pool, worker, &task) == 0) {
+            __atomic_sub_fetch(&thread_pool->parked, 1, __ATOMIC_RELAXED);
+            run_task(worker, &task);
+            continue;
+        }
+        if (__atomic_load_n(&thread_pool->shut_down, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&thread_pool->parked, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        res = futex_wait(&thread_pool->epoch, epoch, timeout);
+        __atomic_sub_fetch(&thread_pool->parked, 1, __ATOMIC_SEQ_CST);
+        if (res < 0 && errno == ETIMEDOUT && retire_worker(thread_pool)) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (next_task(thread_pool, worker, &task) != 0) return;
+            __atomic_add_fetch(&thread_pool->thread_num, 1, __ATOMIC_RELAXED);
+            run_task(worker, &task);
+        }
+    }
+}
 
+/*
+ * Thread is queued at most once until the manager joins it, so the ring of max_thread_num slots
+ * never runs full. The manager doesn't run during shut down, thread_pool_destroy() joins by the states then.
+ * */
+void exit_worker(struct thread_pool_thread *thread) {
+    __atomic_store_n(&thread->state, THREAD_STATE_EXITED, __ATOMIC_RELEASE);
+    if (mpsc_ring_push(&thread->thread_pool->exited, thread) != 0) {
+        LOG_ERROR("Exited thread pool worker isn't queued to be joined");
+    }
+}
+
+/*
+ * Worker is pinned before it allocates its struct, so the memory comes from the arena of its thread
+ * and is first touched on its node. Thieves skip the index until the struct is set up.
+ * */
 void *thread_method(void *arg) {
-    struct thread_pool *thread_pool = (struct thread_pool *) arg;
-#ifdef THREADPOOL
-    for (;;)
-#else
-        while (!queue_is_empty(&thread_pool->task_queue))
-#endif
-    {
-        struct thread_pool_task *task_t;
-#ifdef THREADPOOL
-        pthread_mutex_lock(&thread_pool->queue_mutex);
-        while (queue_is_empty(&thread_pool->task_queue) && !thread_pool->shut_down) {
-//            printf("thread %d waiting\n", pthread_self());
-            pthread_cond_wait(&thread_pool->queue_cond, &thread_pool->queue_mutex);
-        }
-        if (queue_is_empty(&thread_pool->task_queue) && thread_pool->shut_down) {
-            pthread_mutex_unlock(&thread_pool->queue_mutex);
-            pthread_exit(NULL);
-        }
-#endif
-        task_t = queue_pop(&(thread_pool->task_queue));
-#ifdef THREADPOOL
-        pthread_mutex_unlock(&thread_pool->queue_mutex);
-#endif
-//        printf("Thread %d started task\n", pthread_self());
-        task_t->task(task_t->args);
-//        printf("Thread %d finished task\n", pthread_self());
-        free(task_t);
-    }
-}
-
-int thread_pool_init(struct thread_pool *thread_pool, int thread_num) {
+    struct thread_pool_thread *thread = (struct thread_pool_thread *) arg;
+    struct thread_pool *thread_pool = thread->thread_pool;
+    struct thread_pool_worker *worker = thread_pool->workers[thread->index];
+    if (thread_pool->pin_threads) pin_current_thread(thread->index);
+    if (worker == NULL) {
+        if (posix_memalign((void **) &worker, CACHE_LINE_SIZE, sizeof(struct thread_pool_worker)) != 0) {
+            LOG_ERROR("Couldn't allocate thread pool worker");
+            __atomic_sub_fetch(&thread_pool->thread_num, 1, __ATOMIC_RELAXED);
+            exit_worker(thread);
+            return NULL;
+        }
+        memset(worker, 0, sizeof(struct thread_pool_worker));
+        worker->thread_pool = thread_pool;
+        worker->seed = 2654435761u * (thread->index + 1);
+        __atomic_store_n(thread_pool->workers + thread->index, worker, __ATOMIC_RELEASE);
+    }
+    current_worker = worker;
+    run_tasks(thread_pool, worker);
+    current_worker = NULL;
+    if (!__atomic_load_n(&thread_pool->shut_down, __ATOMIC_ACQUIRE)) {
+        LOG_DEBUG("Idle worker %d exits", thread->index);
+        __atomic_add_fetch(&thread_pool->retired_num, 1, __ATOMIC_RELAXED);
+    }
+    exit_worker(thread);
+    return NULL;
+}
+
+//takes the first free index, called by the manager or by thread_pool_init() before the manager starts
+int start_worker(struct thread_pool *thread_pool) {
+    struct thread_pool_thread *thread;
     int i, res;
-    thread_pool->shut_down = 0;
-    queue_init(&thread_pool->task_queue);
-#ifdef THREADPOOL
-    thread_pool->thread_num = thread_num;
-    thread_pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * thread_num);
-    if (thread_pool->threads == NULL) {
+    for (i = 0; i < thread_pool->max_thread_num && thread_pool->threads[i].state != THREAD_STATE_FREE; i++);
+    if (i == thread_pool->max_thread_num) return -1;
+    thread = thread_pool->threads + i;
+    thread->state = THREAD_STATE_RUNNING;
+    __atomic_add_fetch(&thread_pool->thread_num, 1, __ATOMIC_RELAXED);
+    if (i >= thread_pool->worker_num) __atomic_store_n(&thread_pool->worker_num, i + 1, __ATOMIC_RELEASE);
+    if ((res = pthread_create(&thread->thread, NULL, thread_method, thread)) != 0) {
+        LOG_ERROR("Couldn't start thread pool worker: %s", strerror(res));
+        thread->state = THREAD_STATE_FREE;
+        __atomic_sub_fetch(&thread_pool->thread_num, 1, __ATOMIC_RELAXED);
         return -1;
     }
-    if ((res = pthread_mutex_init(&thread_pool->queue_mutex, NULL)) != 0) {
-        return res;
+    thread_pool->started_num++;
+    return 0;
+}
+
+void join_exited_workers(struct thread_pool *thread_pool) {
+    struct thread_pool_thread *thread;
+    while (mpsc_ring_pop(&thread_pool->exited, (void **) &thread) == 0) {
+        pthread_join(thread->thread, NULL);
+        thread->state = THREAD_STATE_FREE;
+    }
+}
+
+/*
+ * Wait of the first timed task among the oldest THREAD_POOL_WAIT_SAMPLE queued ones, so it's a bit less
+ * than the wait of the oldest task. Returns 0 if there is no such task in its slot.
+ * */
+uint64_t oldest_wait(struct thread_pool_queue *queue, uint64_t now) {
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_ACQUIRE);
+    struct thread_pool_slot *slot;
+    uint64_t enqueue_time;
+    int i;
+    for (i = 0; i < THREAD_POOL_WAIT_SAMPLE; i++, pos++) {
+        slot = queue->slots + (pos & (THREAD_POOL_QUEUE_SIZE - 1));
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) return 0;
+        enqueue_time = __atomic_load_n(&slot->enqueue_time, __ATOMIC_RELAXED);
+        if (enqueue_time != 0) return now > enqueue_time ? now - enqueue_time : 0;
+    }
+    return 0;
+}
+
+//the lane that waits the longest decides
+uint64_t oldest_lane_wait(struct thread_pool *thread_pool, uint64_t now) {
+    uint64_t wait, max_wait = 0;
+    int i;
+    for (i = 0; i < THREAD_POOL_PRIORITIES; i++) {
+        wait = oldest_wait(thread_pool->queues + i, now);
+        if (wait > max_wait) max_wait = wait;
     }
-    if ((res = pthread_cond_init(&thread_pool->queue_cond, NULL)) != 0) {
-        return res;
+    return max_wait;
+}
+
+//worker is blocked if it runs the same task it ran at the previous look, THREAD_POOL_MANAGE_INTERVAL ago
+int count_blocked_workers(struct thread_pool *thread_pool) {
+    struct thread_pool_worker *worker;
+    unsigned long task_seq;
+    int i, blocked_num = 0;
+    for (i = 0; i < __atomic_load_n(&thread_pool->worker_num, __ATOMIC_ACQUIRE); i++) {
+        worker = __atomic_load_n(thread_pool->workers + i, __ATOMIC_ACQUIRE);
+        if (worker == NULL) continue;
+        task_seq = __atomic_load_n(&worker->task_seq, __ATOMIC_RELAXED);
+        if (task_seq % 2 == 1 && task_seq == thread_pool->threads[i].seen_task_seq) blocked_num++;
+        thread_pool->threads[i].seen_task_seq = task_seq;
     }
+    __atomic_store_n(&thread_pool->blocked_num, blocked_num, __ATOMIC_RELAXED);
+    return blocked_num;
+}
 
-    for (i = 0; i < thread_num; i++) {
-        if ((res = pthread_create(thread_pool->threads + i, NULL, thread_method, thread_pool)) != 0) {
-            thread_pool->thread_num = i;
-            thread_pool_shut_down(thread_pool, 1);
-            thread_pool_destroy(thread_pool);
-            return res;
+/*
+ * Manager starts one worker at most every THREAD_POOL_MANAGE_INTERVAL and joins the workers that exited.
+ * Queued tasks with no blocked workers don't need more threads, they wait for the CPU and not for the workers.
+ * */
+void *manager_method(void *arg) {
+    struct thread_pool *thread_pool = (struct thread_pool *) arg;
+    struct timespec interval = {0, THREAD_POOL_MANAGE_INTERVAL * 1000000L};
+    uint64_t now, next_stats_time = now_us() + THREAD_POOL_STATS_INTERVAL * 1000000ULL;
+    while (!__atomic_load_n(&thread_pool->shut_down, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        join_exited_workers(thread_pool);
+        now = now_us();
+        if (count_blocked_workers(thread_pool) > 0 &&
+            __atomic_load_n(&thread_pool->thread_num, __ATOMIC_RELAXED) < thread_pool->max_thread_num &&
+            __atomic_load_n(&thread_pool->parked, __ATOMIC_RELAXED) == 0 &&
+            oldest_lane_wait(thread_pool, now) >= THREAD_POOL_GROW_WAIT &&
+            start_worker(thread_pool) == 0) {
+            LOG_INFO("Thread pool grows to %d workers", __atomic_load_n(&thread_pool->thread_num, __ATOMIC_RELAXED));
+        }
+        if (now >= next_stats_time) {
+            thread_pool_log_stats(thread_pool);
+            next_stats_time = now + THREAD_POOL_STATS_INTERVAL * 1000000ULL;
         }
     }
-#endif
-    return 0;
+    return NULL;
 }
 
+void free_queues(struct thread_pool *thread_pool) {
+    int i;
+    for (i = 0; i < THREAD_POOL_PRIORITIES; i++) {
+        free(thread_pool->queues[i].slots);
+    }
+}
 
-int thread_pool_add_task(struct thread_pool *thread_pool, void (*task)(void *), void *args) {
-//    puts("added task");
-    int res;
-    struct thread_pool_task *task_s = (struct thread_pool_task *) malloc(sizeof(struct thread_pool_task));
-    if (task_s == NULL) {
+int thread_pool_init(struct thread_pool *thread_pool, int thread_num, int max_thread_num, int pin_threads) {
+    struct thread_pool_queue *queue;
+    size_t exited_size;
+    int i, res;
+    memset(thread_pool, 0, sizeof(struct thread_pool));
+    thread_pool->min_thread_num = thread_num;
+    thread_pool->max_thread_num = (max_thread_num > thread_num ? max_thread_num : thread_num);
+    thread_pool->pin_threads = pin_threads;
+    for (queue = thread_pool->queues; queue < thread_pool->queues + THREAD_POOL_PRIORITIES; queue++) {
+        queue->slots = (struct thread_pool_slot *) malloc(sizeof(struct thread_pool_slot) * THREAD_POOL_QUEUE_SIZE);
+        if (queue->slots == NULL) {
+            free_queues(thread_pool);
+            return -1;
+        }
+        for (i = 0; i < THREAD_POOL_QUEUE_SIZE; i++) {
+            queue->slots[i].sequence = i;
+        }
+    }
+    if (thread_num == 0) return 0;
+    thread_pool->workers = (struct thread_pool_worker **) calloc(thread_pool->max_thread_num,
+                                                                 sizeof(struct thread_pool_worker *));
+    thread_pool->threads = (struct thread_pool_thread *) calloc(thread_pool->max_thread_num,
+                                                                sizeof(struct thread_pool_thread));
+    for (exited_size = 1; exited_size < (size_t) thread_pool->max_thread_num; exited_size <<= 1);
+    if (thread_pool->workers == NULL || thread_pool->threads == NULL ||
+        mpsc_ring_init(&thread_pool->exited, exited_size) != 0) {
+        free(thread_pool->workers);
+        free(thread_pool->threads);
+        free_queues(thread_pool);
         return -1;
     }
-    task_s->task = task;
-    task_s->args = args;
-
-#ifdef THREADPOOL
-    pthread_mutex_lock(&thread_pool->queue_mutex);
-#endif
-    res = queue_add(&thread_pool->task_queue, task_s);
-    if (res != 0) {
-#ifdef THREADPOOL
-        pthread_mutex_unlock(&thread_pool->queue_mutex);
-#endif
+    for (i = 0; i < thread_pool->max_thread_num; i++) {
+        thread_pool->threads[i].thread_pool = thread_pool;
+        thread_pool->threads[i].index = i;
+    }
+
+    for (i = 0; i < thread_num; i++) {
+        if (start_worker(thread_pool) != 0) break;
+    }
+    if (i == thread_num && thread_pool->max_thread_num > thread_num) {
+        if ((res = pthread_create(&thread_pool->manager, NULL, manager_method, thread_pool)) == 0) {
+            thread_pool->manager_started = 1;
+        } else {
+            LOG_ERROR("Couldn't start thread pool manager: %s", strerror(res));
+        }
+    }
+    if (i < thread_num || (thread_pool->max_thread_num > thread_num && !thread_pool->manager_started)) {
+        thread_pool_shut_down(thread_pool, 1);
+        thread_pool_destroy(thread_pool);
         return -1;
     }
+    return 0;
+}
 
-#ifdef THREADPOOL
-    pthread_cond_signal(&thread_pool->queue_cond);
-    pthread_mutex_unlock(&thread_pool->queue_mutex);
-#endif
 
+int thread_pool_add_task(struct thread_pool *thread_pool, void (*task)(void *), void *args) {
+    struct thread_pool_task new_task = {task, args};
+    return (thread_pool_add_tasks(thread_pool, &new_task, 1, THREAD_POOL_PRIORITY_NORMAL) == 1 ? 0 : -1);
+}
+
+//push claims fewer slots if all of them don't fit, so it returns 0 only when not a slot is free
+int thread_pool_add_tasks(struct thread_pool *thread_pool, struct thread_pool_task *tasks, int task_num,
+                          int priority) {
+    struct thread_pool_queue *queue = thread_pool->queues + priority;
+    int pushed = 0, res;
+    while (pushed < task_num && (res = thread_pool_push_tasks(queue, tasks + pushed, task_num - pushed)) > 0) {
+        pushed += res;
+    }
+    if (pushed > 0) wake_parked_workers(thread_pool, pushed);
+    if (pushed < task_num) errno = EAGAIN;
+    return pushed;
+}
+
+int thread_pool_add_local_task(struct thread_pool *thread_pool, void (*task)(void *), void *args) {
+    struct thread_pool_worker *worker = current_worker;
+    if (worker == NULL || worker->thread_pool != thread_pool || deque_push(&worker->deque, task, args) != 0) {
+        return thread_pool_add_task(thread_pool, task, args);
+    }
+    wake_parked_workers(thread_pool, 1);
     return 0;
 }
 
 void thread_pool_run(struct thread_pool *thread_pool) {
-    thread_method((void *) thread_pool);
+    run_tasks(thread_pool, NULL);
+}
+
+void thread_pool_get_stats(struct thread_pool *thread_pool, struct thread_pool_stats *stats) {
+    struct thread_pool_worker *worker;
+    int i, j, k;
+    stats->thread_num = __atomic_load_n(&thread_pool->thread_num, __ATOMIC_RELAXED);
+    stats->parked_num = __atomic_load_n(&thread_pool->parked, __ATOMIC_RELAXED);
+    stats->blocked_num = __atomic_load_n(&thread_pool->blocked_num, __ATOMIC_RELAXED);
+    stats->started_num = thread_pool->started_num;
+    stats->retired_num = __atomic_load_n(&thread_pool->retired_num, __ATOMIC_RELAXED);
+    memcpy(stats->waits, thread_pool->waits, sizeof(stats->waits));
+    for (i = 0; i < __atomic_load_n(&thread_pool->worker_num, __ATOMIC_ACQUIRE); i++) {
+        worker = __atomic_load_n(thread_pool->workers + i, __ATOMIC_ACQUIRE);
+        if (worker == NULL) continue;
+        for (j = 0; j < THREAD_POOL_PRIORITIES; j++) {
+            for (k = 0; k < THREAD_POOL_WAIT_BUCKETS; k++) {
+                stats->waits[j][k] += __atomic_load_n(worker->waits[j] + k, __ATOMIC_RELAXED);
+            }
+        }
+    }
 }
 
-void clear_task(void *task) {
-    free(task);
+void thread_pool_log_stats(struct thread_pool *thread_pool) {
+    struct thread_pool_stats stats;
+    char histogram[THREAD_POOL_WAIT_BUCKETS * 32];
+    int i, lane, len;
+    thread_pool_get_stats(thread_pool, &stats);
+    LOG_INFO("Thread pool: %d workers (%d..%d), %d parked, %d blocked, %lu started, %lu retired",
+             stats.thread_num, thread_pool->min_thread_num, thread_pool->max_thread_num,
+             stats.parked_num, stats.blocked_num, stats.started_num, stats.retired_num);
+    for (lane = 0; lane < THREAD_POOL_PRIORITIES; lane++) {
+        for (i = 0, len = 0; i < THREAD_POOL_WAIT_BUCKETS - 1; i++) {
+            len += snprintf(histogram + len, sizeof(histogram) - len, " <%luus:%lu", 1UL << i, stats.waits[lane][i]);
+        }
+        snprintf(histogram + len, sizeof(histogram) - len, " >=%luus:%lu", 1UL << (i - 1), stats.waits[lane][i]);
+        LOG_INFO("Thread pool lane %d waits of 1 in %d tasks:%s", lane, THREAD_POOL_WAIT_SAMPLE, histogram);
+    }
 }
 
 int thread_pool_shut_down(struct thread_pool *thread_pool, int clear_queue) {
-    puts("Shuting down");
-#ifdef THREADPOOL
-    pthread_mutex_lock(&thread_pool->queue_mutex);
-#endif
-    thread_pool->shut_down = 1;
+    struct thread_pool_task task;
+    LOG_INFO("Shuting down");
+    __atomic_store_n(&thread_pool->shut_down, 1, __ATOMIC_RELEASE);
     if (clear_queue) {
-        queue_clear(&thread_pool->task_queue, clear_task);
+        while (pop_global(thread_pool, NULL, &task, NULL) == 0);
+        while (steal_task(thread_pool, NULL, &task) == 0);
     }
-#ifdef THREADPOOL
-    pthread_cond_broadcast(&thread_pool->queue_cond);
-    pthread_mutex_unlock(&thread_pool->queue_mutex);
-#endif
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wake_workers(thread_pool, INT_MAX);
     return 0;
 }
 
+//the manager is joined first, so no worker is started while the others are joined
 int thread_pool_destroy(struct thread_pool *thread_pool) {
-#ifdef THREADPOOL
     int i;
-    for (i = 0; i < thread_pool->thread_num; i++) {
-        puts("Joining thread");
-        pthread_join(thread_pool->threads[i], NULL);
-        puts("Thread joined");
+    if (thread_pool->manager_started) pthread_join(thread_pool->manager, NULL);
+    for (i = 0; i < thread_pool->worker_num; i++) {
+        if (thread_pool->threads[i].state != THREAD_STATE_FREE) {
+            LOG_DEBUG("Joining thread");
+            pthread_join(thread_pool->threads[i].thread, NULL);
+            LOG_DEBUG("Thread joined");
+        }
+    }
+    thread_pool_log_stats(thread_pool);
+    for (i = 0; i < thread_pool->worker_num; i++) {
+        free(thread_pool->workers[i]);
     }
+    free(thread_pool->workers);
     free(thread_pool->threads);
-    pthread_cond_destroy(&thread_pool->queue_cond);
-    pthread_mutex_destroy(&thread_pool->queue_mutex);
-#endif
+    mpsc_ring_destroy(&thread_pool->exited);
+    free_queues(thread_pool);
     return 0;
 }
@@ -1,24 +1,164 @@
+/*
+ * Every worker has its own Chase-Lev deque: the worker pushes and pops its bottom without contention,
+ * workers that run dry steal from the top of the deque of a random victim.
+ * Tasks from outside the workers go to the global injection queue, a bounded lock-free MPMC ring
+ * (Vyukov's queue): every slot has a sequence number telling whether it's free for the producer of a position
+ * or filled for its consumer, so producers and consumers only race for the position counters.
+ * Idle workers park on a futex eventcount, producers wake them only if someone is parked.
+ * Every worker allocates and fills its own struct, so a pinned worker keeps its deque on its NUMA node.
+ *
+ * Global queue has a lane per priority. Workers take tasks from the highest priority lane that has them,
+ * but every THREAD_POOL_STARVATION_INTERVAL tasks they look at the lanes from the lowest one,
+ * so a flood of high priority tasks doesn't starve the others.
+ *
+ * Pool with max_thread_num above min_thread_num sizes itself. Its manager thread starts one more worker
+ * when no worker is parked, some are blocked in long tasks and the oldest task of the global queue
+ * has waited for THREAD_POOL_GROW_WAIT. Worker above the minimum that stays parked for THREAD_POOL_IDLE_TIMEOUT exits.
+ * Reading the clock costs about as much as queueing a task, so only one in THREAD_POOL_WAIT_SAMPLE
+ * queue positions is timed, and workers are seen as blocked by a counter rather than by the clock.
+ * */
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
 #include "consts.h"
-#include "queue.h"
+#include "ring.h"
+#include <stdint.h>
+
+#define THREAD_POOL_QUEUE_SIZE 8192         //must be a power of two
+#define THREAD_POOL_DEQUE_SIZE 1024         //must be a power of two
+#define THREAD_POOL_SPINS 16                //times an idle worker yields before it parks
+#define THREAD_POOL_GLOBAL_INTERVAL 61      //worker looks at the global queue first every that many tasks
+#define THREAD_POOL_STARVATION_INTERVAL 8   //lanes are looked at from the lowest priority every that many tasks
+
+#define THREAD_POOL_MANAGE_INTERVAL 10      //ms between the looks of the manager at the pool
+#define THREAD_POOL_GROW_WAIT 5000          //us the oldest queued task waits before the pool grows
+#define THREAD_POOL_IDLE_TIMEOUT 10000      //ms a worker above the minimum stays parked before it exits
+#define THREAD_POOL_STATS_INTERVAL 60       //s between the statistics logged by the manager
+#define THREAD_POOL_WAIT_BUCKETS 16         //bucket i counts waits below 2^i us, the last one the longer waits
+#define THREAD_POOL_WAIT_SAMPLE 16          //must be a power of two
+
+#define THREAD_POOL_PRIORITY_HIGH 0
+#define THREAD_POOL_PRIORITY_NORMAL 1
+#define THREAD_POOL_PRIORITY_LOW 2
+#define THREAD_POOL_PRIORITIES 3
+
+#define THREAD_STATE_FREE 0                 //index has no thread
+#define THREAD_STATE_RUNNING 1
+#define THREAD_STATE_EXITED 2               //thread has exited and is queued to be joined by the manager
+
+struct thread_pool_slot {
+    size_t sequence;                        //position the slot is free for, position + 1 when it's filled
+    void (*task)(void *);
+    void *args;
+    uint64_t enqueue_time;                  //us, 0 if the position isn't timed
+};
+
+struct thread_pool_task {
+    void (*task)(void *);
+    void *args;
+};
+
+//lane of the global queue
+struct thread_pool_queue {
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct thread_pool_slot *slots;
+};
+
+struct thread_pool;
+
+//top is taken by thieves with CAS, bottom is moved only by the owner
+struct thread_pool_deque {
+    long top __attribute__((aligned(CACHE_LINE_SIZE)));
+    long bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct thread_pool_task tasks[THREAD_POOL_DEQUE_SIZE];
+};
+
+//struct of an exited worker is kept with its empty deque and is taken by the next worker of its index
+struct thread_pool_worker {
+    struct thread_pool_deque deque;
+    struct thread_pool *thread_pool;
+    unsigned int seed;                      //chooses victims to steal from
+    unsigned int tick;                      //number of tasks run, counts down to a look at the global queue
+    unsigned int lane_tick;                 //number of looks at the global queue, counts down to the reversed order
+    unsigned long task_seq;                 //incremented before and after every task, odd while a task runs
+    unsigned long waits[THREAD_POOL_PRIORITIES][THREAD_POOL_WAIT_BUCKETS];  //timed waits of the global tasks
+};
+
+struct thread_pool_thread {
+    struct thread_pool *thread_pool;
+    pthread_t thread;
+    int index;
+    int state;
+    unsigned long seen_task_seq;            //task_seq of the worker at the last look of the manager
+};
+
+struct thread_pool_stats {
+    int thread_num;                         //running workers
+    int parked_num;
+    int blocked_num;                        //workers the manager saw running the same task at its last two looks
+    unsigned long started_num;              //workers started since the pool was created
+    unsigned long retired_num;              //workers exited after the idle timeout
+    unsigned long waits[THREAD_POOL_PRIORITIES][THREAD_POOL_WAIT_BUCKETS];  //of one in THREAD_POOL_WAIT_SAMPLE
+};
 
 struct thread_pool {
-    struct queue task_queue;
+    struct thread_pool_queue queues[THREAD_POOL_PRIORITIES];
+    unsigned int epoch __attribute__((aligned(CACHE_LINE_SIZE)));  //futex word, changed to wake parked workers
+    int parked;                             //number of workers that are about to park or parked
     int shut_down;
-#ifdef THREADPOOL
-    int thread_num;
-    pthread_t *threads;
-    pthread_mutex_t queue_mutex;
-    pthread_cond_t queue_cond;
-#endif
+    int thread_num;                         //running workers, 0 if the tasks are run by the caller of thread_pool_run()
+    int min_thread_num;
+    int max_thread_num;
+    int worker_num;                         //indexes that ever had a worker, thieves look at that many
+    int pin_threads;                        //worker i is pinned to the CPU of pin_current_thread(i)
+    int blocked_num;                        //counted by the manager
+    unsigned long started_num;
+    unsigned long retired_num;
+    unsigned int lane_tick;                 //lane_tick of the threads that are not workers
+    unsigned long waits[THREAD_POOL_PRIORITIES][THREAD_POOL_WAIT_BUCKETS];  //of the tasks run by thread_pool_run()
+    struct thread_pool_worker **workers;    //max_thread_num, NULL until the first worker of the index sets it up
+    struct thread_pool_thread *threads;
+    struct mpsc_ring exited;                //threads of the exited workers, the manager joins them
+    pthread_t manager;
+    int manager_started;
 };
 
-int thread_pool_init(struct thread_pool *thread_pool, int thread_num);
+/*
+ * Pool of 0 threads doesn't start any, its queue is run by thread_pool_run() until it is empty.
+ * Pool starts thread_num workers and grows up to max_thread_num, it is fixed if max_thread_num isn't greater.
+ * */
+int thread_pool_init(struct thread_pool *thread_pool, int thread_num, int max_thread_num, int pin_threads);
+
+/*
+ * Puts the task to the normal priority lane of the global queue. Returns -1 with errno EAGAIN if the lane is full:
+ * the caller isn't made to run other tasks meanwhile, so it decides itself whether to retry later or to give up.
+ * */
 int thread_pool_add_task(struct thread_pool *thread_pool, void (*task) (void*), void *args);
+
+/*
+ * Puts task_num tasks to the lane of the priority in order, claiming their slots together, and wakes at most
+ * task_num parked workers once they are queued. Returns the number of queued tasks, the first ones of the array,
+ * it's less than task_num only if the lane is full, errno is EAGAIN then.
+ * */
+int thread_pool_add_tasks(struct thread_pool *thread_pool, struct thread_pool_task *tasks, int task_num,
+                          int priority);
+
+/*
+ * Called by a worker of the pool, puts the task to the worker's own deque, so it's likely run
+ * by the same thread while its data is in the cache. Otherwise it's the same as thread_pool_add_task().
+ * */
+int thread_pool_add_local_task(struct thread_pool *thread_pool, void (*task) (void*), void *args);
+
 void thread_pool_run(struct thread_pool *thread_pool);
+
+//counters are read without stopping the workers, so they may be a bit behind each other
+void thread_pool_get_stats(struct thread_pool *thread_pool, struct thread_pool_stats *stats);
+
+//logs thread counts and the histogram of queue waits, the manager does it every THREAD_POOL_STATS_INTERVAL
+void thread_pool_log_stats(struct thread_pool *thread_pool);
+
 int thread_pool_shut_down(struct thread_pool *thread_pool, int clear_queue);
 int thread_pool_destroy(struct thread_pool *thread_pool);
 
-#endif //THREAD_POOL_H
\ No newline at end of file
+#endif //THREAD_POOL_H
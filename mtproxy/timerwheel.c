@@ -0,0 +1,102 @@
+#include "timerwheel.h"
+
+uint64_t timeval_to_ms(struct timeval *time) {
+    return (uint64_t) time->tv_sec * 1000 + time->tv_usec / 1000;
+}
+
+uint64_t current_time_ms() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return timeval_to_ms(&now);
+}
+
+void timer_list_init(struct timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+void timer_link(struct timer *head, struct timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void timer_unlink(struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    int i;
+    for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+        timer_list_init(wheel->slots + i);
+    }
+    wheel->tick = now / TIMER_WHEEL_TICK;
+    MUTEX_INIT(&wheel->mutex);
+}
+
+void timer_init(struct timer *timer, int (*callback)(void *), void *arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+//timer that has already expired goes to the slot processed by the next advance
+void timer_wheel_link(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t tick = timer->expires / TIMER_WHEEL_TICK;
+    if (tick < wheel->tick) tick = wheel->tick;
+    timer_link(wheel->slots + (tick & (TIMER_WHEEL_SIZE - 1)), timer);
+}
+
+void timer_wheel_set(struct timer_wheel *wheel, struct timer *timer, uint64_t expires) {
+    MUTEX_LOCK(&wheel->mutex);
+    if (timer->next != NULL) timer_unlink(timer);
+    timer->expires = expires;
+    timer_wheel_link(wheel, timer);
+    MUTEX_UNLOCK(&wheel->mutex);
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    MUTEX_LOCK(&wheel->mutex);
+    if (timer->next != NULL) timer_unlink(timer);
+    MUTEX_UNLOCK(&wheel->mutex);
+}
+
+/*
+ * Every slot of the ticks passed since the previous advance is visited once, at most one turn of the wheel.
+ * Timers of later turns found in these slots are left there.
+ * */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now) {
+    struct timer retry, *head, *timer;
+    uint64_t tick, target = now / TIMER_WHEEL_TICK;
+    timer_list_init(&retry);
+    MUTEX_LOCK(&wheel->mutex);
+    for (tick = wheel->tick; tick < target && tick < wheel->tick + TIMER_WHEEL_SIZE; tick++) {
+        head = wheel->slots + (tick & (TIMER_WHEEL_SIZE - 1));
+        timer = head->next;
+        while (timer != head) {
+            struct timer *next = timer->next;
+            if (timer->expires / TIMER_WHEEL_TICK < target) {
+                timer_unlink(timer);
+                if (timer->callback(timer->arg) == TIMER_RETRY) timer_link(&retry, timer);
+            }
+            timer = next;
+        }
+    }
+    if (target > wheel->tick) wheel->tick = target;
+    while (retry.next != &retry) {
+        timer = retry.next;
+        timer_unlink(timer);
+        timer_wheel_link(wheel, timer);
+    }
+    MUTEX_UNLOCK(&wheel->mutex);
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel) {
+    MUTEX_DESTROY(&wheel->mutex);
+}
@@ -0,0 +1,56 @@
+/*
+ * Hashed timer wheel holding the deadlines of connections.
+ * A timer is a list node embedded into its owner, so setting and cancelling it takes O(1) and allocates nothing.
+ * Timers are hashed into TIMER_WHEEL_SIZE slots by the tick they expire at,
+ * a timer expiring more than a turn of the wheel later stays in its slot while the wheel passes it.
+ *
+ * Callbacks of expired timers are run by timer_wheel_advance() with the wheel locked,
+ * so they must not set or cancel timers. A callback returns TIMER_RETRY to be run again at the next tick.
+ * */
+#ifndef PROXY_TIMER_WHEEL_H
+#define PROXY_TIMER_WHEEL_H
+
+#include "consts.h"
+#include "lock.h"
+#include <stdint.h>
+
+#define TIMER_WHEEL_TICK 100                //milliseconds
+#define TIMER_WHEEL_SIZE 1024               //must be a power of two
+
+#define TIMER_DONE 0
+#define TIMER_RETRY 1
+
+struct timer {
+    struct timer *next;                     //NULL if the timer is not set
+    struct timer *prev;
+    uint64_t expires;                       //milliseconds since the epoch
+    int (*callback)(void *arg);
+    void *arg;
+};
+
+struct timer_wheel {
+    struct timer slots[TIMER_WHEEL_SIZE];   //heads of circular lists
+    uint64_t tick;                          //first tick that is not processed yet
+    pthread_mutex_t mutex;
+};
+
+uint64_t timeval_to_ms(struct timeval *time);
+
+uint64_t current_time_ms();
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+void timer_init(struct timer *timer, int (*callback)(void *), void *arg);
+
+//sets the timer to expire at expires, the timer that is already set is moved
+void timer_wheel_set(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+
+//does nothing if the timer is not set
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+//runs callbacks of the timers expired by now, precision is one tick
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+#endif //PROXY_TIMER_WHEEL_H
@@ -1,374 +1,829 @@
+#define _GNU_SOURCE     //accept4()
 #include "consts.h"
-#if defined(THREADPOOL) || defined(SINGLETHREAD)
+#include "engine.h"
 #include "cache.h"
 #include "handlers.h"
 #include "arrayset.h"
 #include "threadpool.h"
-#include "pollfdset.h"
+#include "eventloop.h"
+#include "timerwheel.h"
+#include "affinity.h"
+#include "fifo.h"
+#include "log.h"
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <stddef.h>
+
+/*
+ * Engines built on reactors differ in the way the handlers of ready sources are run.
+ * Handlers of REACTOR_MODE_POOL reactor are run concurrently by the thread pool, while the poller keeps waiting.
+ * Its event loop is one-shot: a source returned by a wait is handled by one task at a time
+ * and the handler re-arms the source as its last action.
+ * */
+#define REACTOR_MODE_SINGLE 0               //handlers are run one after another by the main thread
+#define REACTOR_MODE_POOL 1                 //handlers are run by the thread pool
+#define REACTOR_MODE_MULTI 2                //every reactor runs the handlers of its connections on its own thread
+
+/*
+ * Reactor owns a listening socket, an event loop and the connections accepted from that socket.
+ * Connections never leave their reactor, only the cache map is shared between reactors.
+ * Multireactor engine runs a reactor per CPU on its own thread, every reactor has its own
+ * SO_REUSEPORT listening socket, so the kernel spreads new connections between them.
+ * Singlethread and threadpool engines have one reactor.
+ * */
+struct reactor {
+    struct event_loop loop;
+    struct event_source listen_source;
+    int reserve_fd;                         //closed to accept and drop a connection when descriptors run out
+    struct event_source wakeup_source;      //eventfd written when caches wake up the clients of the reactor
+    struct client *woken;                   //list of the clients woken up by their caches
+    struct fifo connected;                  //servers connected by the connect pool, added to the loop by handle_wakeup()
+    struct arrayset clients;
+    struct arrayset servers;
+    struct timer_wheel timers;
+    struct event_source *expired[EVENT_LOOP_MAX_EVENTS];    //sources of the timed out connections
+    int expired_num;
+    pthread_mutex_t wakeup_mutex;           //caches wake up clients from the threads of their servers
+    pthread_mutex_t client_mutex;
+    pthread_mutex_t server_mutex;
+    pthread_t thread;                       //used by multireactor engine
+};
 
 struct client {
     struct client_handler_args args;
-    struct pollfd *pollfd;
+    struct event_source source;
+    struct timer timer;
+    struct cache_subscriber subscriber;     //subscribed to the cache of the response while it has no bytes to send
+    struct client *woken_next;              //list of the woken clients of the reactor
+    struct client *woken_prev;
+    int woken;                              //the client is in the list
+    struct reactor *reactor;
+    int set_index;                          //slot in the clients of the reactor
 };
 
 struct server {
     struct server_handler_args *args;
-    struct pollfd *pollfd;
+    struct event_source source;
+    struct timer timer;
+    struct reactor *reactor;
+    int set_index;                          //slot in the servers of the reactor
+    struct fifo_link link;                  //in the connected servers of the reactor
 };
 
-struct cache_map map = CACHE_MAP_INITIALIZER;
-struct arrayset clients = ARRAY_SET_INITIALIZER,
-        servers = ARRAY_SET_INITIALIZER;
-struct pollfdset pollfdset;
+struct reactor *reactors;
+int reactor_num;
+int reactor_mode;
+int pin_threads;                            //reactor threads or pool workers are pinned to CPUs
 struct thread_pool thread_pool;
-#ifdef THREADPOOL
-pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
-sem_t semaphore;
-#endif
+struct thread_pool connect_pool;            //connects servers for the multireactor, whose threads run handlers themselves
 
-short running = 1;
+int raise_open_files_limit();
 
-int handle_args(int argc, char *argv[], struct sockaddr_in *my_addr);
+void handle_client(void *arg);
 
-int init_listening_pollfd(struct pollfd *pollfd, struct sockaddr_in *my_addr);
+void handle_server(void *arg);
 
-int init_sigint_handler();
+int schedule_tasks(struct thread_pool_task *tasks, int task_num, int priority);
 
-int create_server_connection(struct server_handler_args *args) {
-    struct server *server = (struct server *) malloc(sizeof(struct server));
-    if (server == NULL) return -1;
-    server->pollfd = allocate_pollfd(&pollfdset, args->socket, POLLIN | POLLOUT);
-    if (server->pollfd == NULL) {
+/*
+ * Timed out connection is handled like a ready one with no revents, its handler finds out that the deadline
+ * has passed. The source is disarmed first, if it isn't armed, the connection is being handled now.
+ * */
+int expire_source(struct reactor *reactor, struct event_source *source) {
+    if (reactor->expired_num == EVENT_LOOP_MAX_EVENTS || event_loop_disarm(&reactor->loop, source) != 1) {
+        return TIMER_RETRY;
+    }
+    source->revents = 0;
+    reactor->expired[reactor->expired_num++] = source;
+    return TIMER_DONE;
+}
+
+int client_timer_expired(void *arg) {
+    struct client *client = (struct client *) arg;
+    return expire_source(client->reactor, &client->source);
+}
+
+int server_timer_expired(void *arg) {
+    struct server *server = (struct server *) arg;
+    return expire_source(server->reactor, &server->source);
+}
+
+void set_client_timer(struct client *client) {
+    struct timeval deadline;
+    if (client_deadline(&client->args, &deadline)) {
+        timer_wheel_set(&client->reactor->timers, &client->timer, timeval_to_ms(&deadline));
+    } else {
+        timer_wheel_cancel(&client->reactor->timers, &client->timer);
+    }
+}
+
+void set_server_timer(struct server *server) {
+    struct timeval deadline;
+    server_deadline(server->args, &deadline);
+    timer_wheel_set(&server->reactor->timers, &server->timer, timeval_to_ms(&deadline));
+}
+
+//is called with wakeup_mutex locked before a client or a server is queued, the eventfd is written for the first one
+void wake_reactor(struct reactor *reactor) {
+    uint64_t value = 1;
+    if (reactor->woken == NULL && fifo_is_empty(&reactor->connected) &&
+        write(reactor->wakeup_source.fd, &value, sizeof(value)) < 0) {
+        LOG_WARN("Couldn't wake up the reactor: %s", strerror(errno));
+    }
+}
+
+/*
+ * Cache notifies the client from the thread of the server, which may be a thread of another reactor,
+ * so the client is queued and the reactor is woken up through its eventfd.
+ * */
+void client_notified(struct cache_subscriber *subscriber) {
+    struct client *client = (struct client *) ((char *) subscriber - offsetof(struct client, subscriber));
+    struct reactor *reactor = client->reactor;
+    MUTEX_LOCK(&reactor->wakeup_mutex);
+    if (!client->woken) {
+        wake_reactor(reactor);
+        client->woken = 1;
+        client->woken_prev = NULL;
+        client->woken_next = reactor->woken;
+        if (reactor->woken != NULL) reactor->woken->woken_prev = client;
+        reactor->woken = client;
+    }
+    MUTEX_UNLOCK(&reactor->wakeup_mutex);
+}
+
+//is called with wakeup_mutex locked
+void unlink_woken_client(struct reactor *reactor, struct client *client) {
+    if (client->woken_prev != NULL) {
+        client->woken_prev->woken_next = client->woken_next;
+    } else {
+        reactor->woken = client->woken_next;
+    }
+    if (client->woken_next != NULL) client->woken_next->woken_prev = client->woken_prev;
+    client->woken = 0;
+}
+
+//unsubscribes the client, so that it isn't woken up after it's freed
+void forget_client(struct client *client) {
+    struct reactor *reactor = client->reactor;
+    cache_unsubscribe(client->args.reader.cache, &client->subscriber);
+    MUTEX_LOCK(&reactor->wakeup_mutex);
+    if (client->woken) unlink_woken_client(reactor, client);
+    MUTEX_UNLOCK(&reactor->wakeup_mutex);
+}
+
+//client is read only while it may send more requests and its pipeline has room
+int client_in_events(struct client *client) {
+    return (client_wants_request(&client->args) ? POLLIN : 0);
+}
+
+void park_client(void *arg) {
+    struct client *client = (struct client *) arg;
+    event_loop_set_events(&client->reactor->loop, &client->source, client_in_events(client));
+    event_loop_rearm(&client->reactor->loop, &client->source);
+}
+
+/*
+ * Client that has sent every received byte of its response waits for the server without POLLOUT,
+ * it's subscribed to the cache and woken up when more bytes come. Its source is re-armed with the cache locked,
+ * so the cache can't notify it after it's decided to wait but before it can be woken up.
+ * */
+void rearm_client(struct client *client) {
+    struct reactor *reactor = client->reactor;
+    int events = client_in_events(client);
+    if (client_has_response(&client->args)) {
+        if (cache_subscribe(&client->args.reader, &client->subscriber, park_client, client)) return;
+        events |= POLLOUT;
+    }
+    event_loop_set_events(&reactor->loop, &client->source, events);
+    event_loop_rearm(&reactor->loop, &client->source);
+}
+
+//adds the connected server to the loop of its reactor, the server is destroyed if it can't be added
+void add_server(struct server *server) {
+    struct reactor *reactor = server->reactor;
+    int res;
+    event_source_init(&server->source, server->args->socket, POLLIN | POLLOUT, handle_server, server);
+    //the server can be handled as soon as it's added, so it's added under the lock of remove_server()
+    MUTEX_LOCK(&reactor->server_mutex);
+    set_server_timer(server);
+    res = event_loop_add(&reactor->loop, &server->source);
+    if (res == 0) {
+        arrayset_add(&reactor->servers, server);
+    } else {
+        timer_wheel_cancel(&reactor->timers, &server->timer);
+    }
+    MUTEX_UNLOCK(&reactor->server_mutex);
+    if (res != 0) {
+        destroy_server(server->args);
+        free(server);
+    }
+}
+
+/*
+ * Resolving the host may wait for DNS, so the server is connected by a task of its own. The cache of the server
+ * is already in the map, if the server fails here, its clients find the response finished without bytes.
+ * Loop and timers of a multireactor are used by its thread only, so the server connected by the connect pool
+ * is handed back to the reactor through its eventfd. Singlethread engine has no locks and connects in its own thread.
+ * */
+void connect_server(void *arg) {
+    struct server *server = (struct server *) arg;
+    struct reactor *reactor = server->reactor;
+    if (!running || server_connect(server->args, 0) != 0) {
+        destroy_server(server->args);
         free(server);
+        return;
+    }
+    if (reactor_mode != REACTOR_MODE_MULTI) {
+        add_server(server);
+        return;
+    }
+    MUTEX_LOCK(&reactor->wakeup_mutex);
+    wake_reactor(reactor);
+    fifo_push(&reactor->connected, &server->link);
+    MUTEX_UNLOCK(&reactor->wakeup_mutex);
+}
+
+/*
+ * Context is the reactor of the client, the server connection is placed to the same reactor.
+ * Thread pool connects it in the low priority lane, so misses being set up don't delay the hits queued after them.
+ * Multireactor leaves it to the connect pool, so that the reactor thread never waits for DNS.
+ * */
+int create_server_connection(struct server_handler_args *args, void *context) {
+    struct reactor *reactor = (struct reactor *) context;
+    struct server *server = (struct server *) malloc(sizeof(struct server));
+    struct thread_pool_task task;
+    if (server == NULL) {
+        destroy_server(args);
         return -1;
     }
+    timer_init(&server->timer, server_timer_expired, server);
     server->args = args;
-#ifdef THREADPOOL
-    pthread_mutex_lock(&server_mutex);
-#endif
-    arrayset_add(&servers, server);
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&server_mutex);
-#endif
+    server->reactor = reactor;
+    task.task = connect_server;
+    task.args = server;
+    if ((reactor_mode != REACTOR_MODE_MULTI ? schedule_tasks(&task, 1, THREAD_POOL_PRIORITY_LOW) :
+         thread_pool_add_tasks(&connect_pool, &task, 1, THREAD_POOL_PRIORITY_NORMAL)) != 1) {
+        LOG_WARN("Couldn't queue connecting to the server: %s", strerror(errno));
+        destroy_server(args);
+        free(server);
+        return -1;
+    }
     return 0;
 }
 
-void handle_accept(void *arg) {
-    struct pollfd *pollfd = (struct pollfd *) arg;
-    int new_socket;
-    struct pollfd *client_pollfd;
+void add_client(struct reactor *reactor, int new_socket) {
     struct client *client;
-    puts("handling accept");
-    if (pollfd->revents != POLLIN) {
-        printf("Unexpected events on listening pollfd: %d\n", pollfd->revents);
-        running = 0;
-#ifdef THREADPOOL
-        sem_post(&semaphore);
-#endif
-        return;
-    }
-    new_socket = accept(pollfd->fd, NULL, NULL);
-    puts("accepted");
-    if (new_socket < 0) {
-        fprintf(stderr, "Accept failed: %s\n");
-    }
-    client_pollfd = allocate_pollfd(&pollfdset, new_socket, POLLIN);
-    if (client_pollfd == NULL) {
-        puts("Couldn't allocate pollfd for client, closing connection");
-        close(new_socket);
-#ifdef THREADPOOL
-        sem_post(&semaphore);
-#endif
-        return;
+    int enable = 1;
+    //header and body of a response are sent by separate send() calls, Nagle would hold the body back
+    if (setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0) {
+        LOG_WARN("setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
     }
-//    puts("allocated");
-#ifdef THREADPOOL
-    pthread_mutex_lock(&client_mutex);
-#endif
+    MUTEX_LOCK(&reactor->client_mutex);
 //    puts("locked");
     client = (struct client *) malloc(sizeof(struct client));
     if (client == NULL) {
-        free_pollfd(&pollfdset, client_pollfd);
         close(new_socket);
     } else {
-        client->pollfd = client_pollfd;
-        client_handler_args_init(&client->args, new_socket, create_server_connection, &map);
-        arrayset_add(&clients, client);
+        event_source_init(&client->source, new_socket, POLLIN, handle_client, client);
+        timer_init(&client->timer, client_timer_expired, client);
+        cache_subscriber_init(&client->subscriber, client_notified);
+        client->woken = 0;
+        client->reactor = reactor;
+        client_handler_args_init(&client->args, new_socket, create_server_connection, reactor, &map);
+        set_client_timer(client);
+        if (event_loop_add(&reactor->loop, &client->source) < 0) {
+            LOG_ERROR("Couldn't add client to the event loop, closing connection");
+            timer_wheel_cancel(&reactor->timers, &client->timer);
+            destroy_client(&client->args);
+            free(client);
+        } else {
+            arrayset_add(&reactor->clients, client);
+        }
+    }
+    MUTEX_UNLOCK(&reactor->client_mutex);
+}
+
+/*
+ * Without free descriptors the pending connection can't be accepted and the listening socket stays ready,
+ * so the reserve descriptor is given up to accept the connection and close it at once.
+ * Returns -1 if there is no reserve descriptor.
+ * */
+int drop_pending_connection(struct reactor *reactor) {
+    int sockfd;
+    if (reactor->reserve_fd < 0) return -1;
+    close(reactor->reserve_fd);
+    sockfd = accept(reactor->listen_source.fd, NULL, NULL);
+    if (sockfd >= 0) close(sockfd);
+    reactor->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return 0;
+}
+
+//accepts pending connections until the backlog is empty or ACCEPT_BUDGET connections are accepted
+void handle_accept(void *arg) {
+    struct reactor *reactor = (struct reactor *) arg;
+    struct event_source *source = &reactor->listen_source;
+    int i, new_socket, revents = source->revents;
+    LOG_DEBUG("handling accept");
+    source->revents = 0;
+    if (revents != POLLIN) {
+        LOG_ERROR("Unexpected events on listening socket: %d", revents);
+        running = 0;
+        return;
+    }
+    for (i = 0; i < ACCEPT_BUDGET; i++) {
+        new_socket = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket >= 0) {
+            add_client(reactor, new_socket);
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno == EMFILE || errno == ENFILE) {
+            LOG_WARN("Out of descriptors, dropping new connection");
+            if (drop_pending_connection(reactor) == 0) continue;
+        } else {
+            LOG_ERROR("Accept failed: %s", strerror(errno));
+        }
+        break;
     }
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&client_mutex);
-    sem_post(&semaphore);
-#endif
+    event_loop_rearm(&reactor->loop, source);
 }
 
 void remove_client(struct client *client) {
-    puts("removing client");
-#ifdef THREADPOOL
-    pthread_mutex_lock(&client_mutex);
-#endif
-    arrayset_remove(&clients, client);
-    free_pollfd(&pollfdset, client->pollfd);
+    struct reactor *reactor = client->reactor;
+    LOG_DEBUG("removing client");
+    timer_wheel_cancel(&reactor->timers, &client->timer);
+    forget_client(client);
+    MUTEX_LOCK(&reactor->client_mutex);
+    arrayset_remove(&reactor->clients, client);
+    event_loop_remove(&reactor->loop, &client->source);
     destroy_client(&client->args);
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&client_mutex);
-#endif
+    free(client);
+    MUTEX_UNLOCK(&reactor->client_mutex);
 }
 
 void remove_server(struct server *server) {
+    struct reactor *reactor = server->reactor;
 //    puts("removing server");
-#ifdef THREADPOOL
-    pthread_mutex_lock(&server_mutex);
-#endif
-    arrayset_remove(&servers, server);
-    free_pollfd(&pollfdset, server->pollfd);
+    timer_wheel_cancel(&reactor->timers, &server->timer);
+    MUTEX_LOCK(&reactor->server_mutex);
+    arrayset_remove(&reactor->servers, server);
+    event_loop_remove(&reactor->loop, &server->source);
     destroy_server(server->args);
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&server_mutex);
-#endif
+    free(server);
+    MUTEX_UNLOCK(&reactor->server_mutex);
 }
 
+/*
+ * Handler is called until the socket would block, so that a ready event is used up at once,
+ * but a connection moves at most IO_BUDGET bytes per event, the rest waits for the next one.
+ * */
+#define DRAIN(res, handler, args) do {                                                              \
+    size_t start = (args)->bytes_transferred;                                                       \
+    while ((((res) = (handler)(args)) == HANDLER_CONTINUE &&                                         \
+            (args)->bytes_transferred - start < IO_BUDGET) || (res) == HANDLER_EINTR) {             \
+        if (!running) break;                                                                        \
+    }                                                                                               \
+    if ((res) == HANDLER_WOULDBLOCK) (res) = HANDLER_CONTINUE;                                      \
+} while (0)
+
 void handle_client(void *arg) {
     int res1 = HANDLER_CONTINUE, res2 = HANDLER_CONTINUE;
     struct client *client = (struct client *) arg;
+    struct reactor *reactor = client->reactor;
+    int revents = client->source.revents;
+    struct timeval now;
 //    puts("Handling client");
-    if (client->pollfd->revents & (POLLHUP | POLLERR)) {
-        perror("Error or hang up on client socket");
+    client->source.revents = 0;
+    if (revents & (POLLHUP | POLLERR)) {
+        LOG_DEBUG("Error or hang up on client socket");
+        remove_client(client);
+        return;
+    }
+    //deadline is checked on every event too, so that a slow client sending its header by bytes is closed
+    gettimeofday(&now, NULL);
+    if (client_timed_out(&client->args, &now)) {
+        LOG_DEBUG("Client timed out");
         remove_client(client);
-#ifdef THREADPOOL
-        sem_post(&semaphore);
-#endif
         return;
     }
 
-//    printf("SDLKSFJL:SKDJFL:SD  POLLIN %d\n", client->pollfd->revents & POLLIN);
-    if (client->pollfd->revents & POLLIN && running) {
+//    printf("SDLKSFJL:SKDJFL:SD  POLLIN %d\n", revents & POLLIN);
+    if (revents & POLLIN && running) {
 //        puts("Handling in");
-        while ((res1 = client_handle_in(&client->args)) == HANDLER_EINTR && running);
+        DRAIN(res1, client_handle_in, &client->args);
         if (res1 != HANDLER_CONTINUE) {
-            client->pollfd->events &= ~POLLIN;
-            client->pollfd->events |= POLLOUT;
-            printf("Finished receiving request from client: %d\n", res1);
-//            sleep(1);
+            event_loop_set_events(&reactor->loop, &client->source, client->source.events & ~POLLIN);
+            LOG_DEBUG("Finished receiving requests from client: %d", res1);
         }
     }
 
-//    printf("SDLKSFJL:SKDJFL:SD  POLLOUT %d\n", client->pollfd->revents & POLLOUT);
-    if (client->pollfd->revents & POLLOUT && running && res1 != HANDLER_ERROR) {
+//    printf("SDLKSFJL:SKDJFL:SD  POLLOUT %d\n", revents & POLLOUT);
+    if (revents & POLLOUT && running && res1 != HANDLER_ERROR) {
 //        puts("client handling out");
-        while ((res2 = client_handle_out(&client->args)) == HANDLER_EINTR && running);
+        DRAIN(res2, client_handle_out, &client->args);
 //        printf("Client handled out %d\n", res2);
-        if (res2 != HANDLER_CONTINUE) {
-            client->pollfd->events &= ~POLLOUT;
-            printf("Finished sending data to client: %d\n", res2);
-        }
     }
-    if (res1 == HANDLER_ERROR || res2 == HANDLER_ERROR || res2 == HANDLER_FINISHED || !running) {
+    if (res1 == HANDLER_ERROR || res2 == HANDLER_ERROR || res2 == HANDLER_FINISHED ||
+        (res1 == HANDLER_FINISHED && !client_has_response(&client->args)) || !running) {
         remove_client(client);
+    } else {
+        set_client_timer(client);
+        rearm_client(client);
     }
-#ifdef THREADPOOL
-    sem_post(&semaphore);
-#endif
 }
 
 void handle_server(void *arg) {
     int res1 = HANDLER_CONTINUE, res2 = HANDLER_CONTINUE;
     struct server *server = (struct server *) arg;
+    struct reactor *reactor = server->reactor;
+    int revents = server->source.revents;
+    struct timeval now;
 //    puts("Handling server");
-    if (server->pollfd->revents & (POLLHUP | POLLERR)) {
-        perror("Error or hang up on server socket");
+    server->source.revents = 0;
+    if (revents & (POLLHUP | POLLERR)) {
+        LOG_DEBUG("Error or hang up on server socket");
+        remove_server(server);
+        return;
+    }
+    gettimeofday(&now, NULL);
+    if (revents == 0 && server_timed_out(server->args, &now)) {
+        LOG_WARN("Server timed out");
         remove_server(server);
-#ifdef THREADPOOL
-        sem_post(&semaphore);
-#endif
         return;
     }
 
-//    printf("server-----------------  POLLIN %d\n", server->pollfd->revents & POLLIN);
-    if (server->pollfd->revents & POLLIN && running) {
-        while ((res1 = server_handle_in(server->args)) == HANDLER_EINTR && running);
+//    printf("server-----------------  POLLIN %d\n", revents & POLLIN);
+    if (revents & POLLIN && running) {
+        DRAIN(res1, server_handle_in, server->args);
 //        printf("Server handled in %d\n", res1);
 //        sleep(1);
         if (res1 != HANDLER_CONTINUE) {
-            server->pollfd->events &= ~POLLIN;
-            printf("Finished receiving daata from server: %d\n", res1);
+            event_loop_set_events(&reactor->loop, &server->source, server->source.events & ~POLLIN);
+            LOG_DEBUG("Finished receiving daata from server: %d", res1);
         }
     }
-//    printf("server-----------------  POLLOUT %d\n", server->pollfd->revents & POLLOUT);
-    if (server->pollfd->revents & POLLOUT && running && res1 != HANDLER_ERROR) {
-        while ((res2 = server_handle_out(server->args)) == HANDLER_EINTR && running);
+//    printf("server-----------------  POLLOUT %d\n", revents & POLLOUT);
+    if (revents & POLLOUT && running && res1 != HANDLER_ERROR) {
+        DRAIN(res2, server_handle_out, server->args);
 //        printf("Server handled out %d\n", res2);
 //        sleep(1);
         if (res2 != HANDLER_CONTINUE) {
-            server->pollfd->events &= ~POLLOUT;
-            printf("Finished sending request to server:%d\n", res2);
+            event_loop_set_events(&reactor->loop, &server->source, server->source.events & ~POLLOUT);
+            LOG_DEBUG("Finished sending request to server:%d", res2);
         }
     }
     if (res1 == HANDLER_ERROR || res2 == HANDLER_ERROR || res1 == HANDLER_FINISHED || !running) {
         remove_server(server);
+    } else {
+        set_server_timer(server);
+        event_loop_rearm(&reactor->loop, &server->source);
+    }
+}
+
+/*
+ * Connections of a multireactor are handled by the thread of their reactor, one after another.
+ * Thread pool gets the tasks of a wait as one batch, so they are queued and the workers are woken once.
+ * Returns the number of scheduled tasks, the first ones of the array, it's less than task_num if the lane is full.
+ * */
+int schedule_tasks(struct thread_pool_task *tasks, int task_num, int priority) {
+    int i;
+    if (reactor_mode == REACTOR_MODE_MULTI) {
+        for (i = 0; i < task_num; i++) {
+            tasks[i].task(tasks[i].args);
+        }
+        return task_num;
     }
-#ifdef THREADPOOL
-    sem_post(&semaphore);
-#endif
+    i = thread_pool_add_tasks(&thread_pool, tasks, task_num, priority);
+    if (i < task_num) LOG_WARN("Lane %d of the thread pool is full, %d tasks are put off", priority, task_num - i);
+    return i;
 }
 
-#define ADD_TASK_TO_SCHEDULE(task, arg)                       \
-if (thread_pool_add_task(&thread_pool, (task), (arg)) != 0) {  \
-    printf("thread_pool_add_task() failed.\n");                 \
-    running = 0;                                                 \
-    return; }
+//sources whose handlers didn't fit to the thread pool are re-armed, so that they are returned by a later wait
+void put_off_sources(struct reactor *reactor, struct event_source **sources, int source_num) {
+    int i;
+    for (i = 0; i < source_num; i++) {
+        event_loop_rearm(&reactor->loop, sources[i]);
+    }
+}
 
+/*
+ * Accepting and waking up clients are control tasks, they go to the high priority lane with the next poll_task(),
+ * so a queue of connection handlers doesn't delay new events. Handlers of the connections go to the normal lane.
+ * */
 void poll_task(void *arg) {
 //    puts("Polling");
-    struct pollfd *listening_pollfd = (struct pollfd *) arg;
-    int pollret = poll(pollfdset.fds, pollfdset.max_occupied_fd, POLL_TIMEOUT);
-    int i, task_cnt = 0, res;
-
-//    printf("Poll : %d\n", pollret);
-    if (pollret < 0) {
-        perror("Pollret: ");
-    }
-
-    if (task_cnt < pollret && listening_pollfd->revents != 0) {
-        task_cnt++;
-        ADD_TASK_TO_SCHEDULE(handle_accept, (void *) listening_pollfd);
-    }
-#ifdef THREADPOOL
-    pthread_mutex_lock(&client_mutex);
-#endif
-    for (i = 0; i < clients.data_size && task_cnt < pollret; i++) {
-        struct client *client = (struct client *) clients.arr[i];
-//        puts("Checking client");
-        if (client->pollfd->revents != 0) {
-//            puts("starting client");
-            task_cnt++;
-            ADD_TASK_TO_SCHEDULE(handle_client, (void *) client);
-        }
+    struct reactor *reactor = (struct reactor *) arg;
+    struct event_source *ready[EVENT_LOOP_MAX_EVENTS], *sources[EVENT_LOOP_MAX_EVENTS], *control_sources[2];
+    struct thread_pool_task tasks[EVENT_LOOP_MAX_EVENTS], control[2];
+    int i, queued, task_num = 0, control_num = 0;
+    int task_cnt = event_loop_wait(&reactor->loop, ready, EVENT_LOOP_MAX_EVENTS, POLL_TIMEOUT);
+
+//    printf("Poll : %d\n", task_cnt);
+    if (task_cnt < 0) {
+        LOG_ERROR("Event loop wait failed: %s", strerror(errno));
+        task_cnt = 0;
     }
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&client_mutex);
-    pthread_mutex_lock(&server_mutex);
-#endif
-    for (i = 0; i < servers.data_size && task_cnt < pollret; i++) {
-        struct server *server = (struct server *) servers.arr[i];
-        if (server->pollfd->revents != 0) {
-            task_cnt++;
-            ADD_TASK_TO_SCHEDULE(handle_server, (void *) server);
+    //each ready source carries its handler, so only ready connections are visited
+    for (i = 0; i < task_cnt; i++) {
+        if (ready[i] == &reactor->listen_source || ready[i] == &reactor->wakeup_source) {
+            control_sources[control_num] = ready[i];
+            control[control_num].task = ready[i]->handler;
+            control[control_num++].args = ready[i]->arg;
+        } else {
+            sources[task_num] = ready[i];
+            tasks[task_num].task = ready[i]->handler;
+            tasks[task_num++].args = ready[i]->arg;
         }
     }
-#ifdef THREADPOOL
-    pthread_mutex_unlock(&server_mutex);
-//    puts("poll task waiting other tasks");
-    for (i = 0; i < task_cnt; i++) {
-        while (sem_wait(&semaphore) == -1 && errno == EINTR);
+    queued = schedule_tasks(control, control_num, THREAD_POOL_PRIORITY_HIGH);
+    put_off_sources(reactor, control_sources + queued, control_num - queued);
+    queued = schedule_tasks(tasks, task_num, THREAD_POOL_PRIORITY_NORMAL);
+    put_off_sources(reactor, sources + queued, task_num - queued);
+    /*
+     * Deadlines are checked as often as the loop waits, at least every POLL_TIMEOUT. Expired sources that
+     * didn't fit to the thread pool stay disarmed and are scheduled first by the next call. Level triggered loop
+     * would re-arm them, but the singlethread pool is run empty before every wait, so its lanes are never full.
+     * */
+    timer_wheel_advance(&reactor->timers, current_time_ms());
+    task_num = 0;
+    for (i = 0; i < reactor->expired_num; i++) {
+        tasks[task_num].task = reactor->expired[i]->handler;
+        tasks[task_num++].args = reactor->expired[i]->arg;
     }
-//    puts("poll task done waiting other tasks");
-#endif
+    if (reactor_mode == REACTOR_MODE_SINGLE) log_flush();
+    queued = schedule_tasks(tasks, task_num, THREAD_POOL_PRIORITY_NORMAL);
+    reactor->expired_num = task_num - queued;
+    memmove(reactor->expired, reactor->expired + queued, sizeof(struct event_source *) * reactor->expired_num);
+    if (reactor_mode != REACTOR_MODE_POOL) return;
     if (running) {
-        ADD_TASK_TO_SCHEDULE(poll_task, arg);
+        tasks[0].task = poll_task;
+        tasks[0].args = arg;
+        //high lane holds only the control tasks and the polls of the reactors, so its slot frees up soon
+        while (schedule_tasks(tasks, 1, THREAD_POOL_PRIORITY_HIGH) == 0) {
+            sched_yield();
+        }
     } else {
         thread_pool_shut_down(&thread_pool, 0);
     }
 }
 
+/*
+ * Woken client is handled like a ready one with POLLOUT. If its source isn't armed, the client is being handled
+ * now or is about to be, then it finds the new bytes itself. Level triggered loop can re-arm only
+ * EVENT_LOOP_MAX_EVENTS disarmed sources per wait, so the rest of the clients are left for the next call.
+ * Its next wait also re-arms the woken clients, so they are handled right here rather than by later tasks.
+ * Thread pool gets them as local tasks of this worker: they mostly send the same new bytes of a cache,
+ * so they are run here while the bytes are warm, unless idle workers steal them.
+ * */
+void handle_wakeup(void *arg) {
+    struct reactor *reactor = (struct reactor *) arg;
+    struct client *woken[EVENT_LOOP_MAX_EVENTS], *client;
+    struct fifo connected;
+    struct fifo_link *link;
+    int i, armed, woken_num = 0;
+    uint64_t value = 1;
+    reactor->wakeup_source.revents = 0;
+    MUTEX_LOCK(&reactor->wakeup_mutex);
+    while (read(reactor->wakeup_source.fd, &value, sizeof(value)) < 0 && errno == EINTR);
+    while (reactor->woken != NULL && woken_num < EVENT_LOOP_MAX_EVENTS) {
+        client = reactor->woken;
+        //client that can't be disarmed stays in the list, the eventfd written below brings it back after the wait
+        if ((armed = event_loop_disarm(&reactor->loop, &client->source)) < 0) break;
+        unlink_woken_client(reactor, client);
+        if (armed) {
+            client->source.revents = POLLOUT;
+            woken[woken_num++] = client;
+        }
+    }
+    connected = reactor->connected;
+    fifo_init(&reactor->connected);
+    value = 1;
+    if (reactor->woken != NULL && write(reactor->wakeup_source.fd, &value, sizeof(value)) < 0) {
+        LOG_WARN("Couldn't wake up the reactor: %s", strerror(errno));
+    }
+    MUTEX_UNLOCK(&reactor->wakeup_mutex);
+    while ((link = fifo_pop(&connected)) != NULL) {
+        add_server(FIFO_ENTRY(link, struct server, link));
+    }
+    for (i = 0; i < woken_num; i++) {
+        //client that doesn't fit to the full queue is handled right here, as by the other reactors
+        if (reactor_mode != REACTOR_MODE_POOL ||
+            thread_pool_add_local_task(&thread_pool, handle_client, woken[i]) != 0) {
+            handle_client(woken[i]);
+        }
+    }
+    event_loop_rearm(&reactor->loop, &reactor->wakeup_source);
+}
+
+//reactor is pinned before it accepts, so its connections are allocated on its NUMA node
+void *reactor_thread(void *arg) {
+    if (pin_threads) pin_current_thread((int) ((struct reactor *) arg - reactors));
+    while (running) {
+        poll_task(arg);
+    }
+    return NULL;
+}
+
 void free_client(void *arg) {
     struct client *client = (struct client *) arg;
+    forget_client(client);
+    event_loop_remove(&client->reactor->loop, &client->source);
     destroy_client(&client->args);
-    free_pollfd(&pollfdset, client->pollfd);
     free(arg);
 }
 
 void free_server(void *arg) {
     struct server *server = (struct server *) arg;
+    event_loop_remove(&server->reactor->loop, &server->source);
     destroy_server(server->args);
-    free_pollfd(&pollfdset, server->pollfd);
     free(server);
 }
 
-int main(int argc, char *argv[]) {
-    struct sockaddr_in my_addr;
-    struct pollfd *listen_pollfd;
-//    struct thread_pool *thread_pool;
-    pollfdset_init(&pollfdset);
-//    puts("pksdkl;fjsdkl'fgdgdsgsdfgsdflkughsd;ofhg");
-    listen_pollfd = allocate_pollfd(&pollfdset, 0, POLLIN);
-
-    if (handle_args(argc, argv, &my_addr) < 0 ||
-        init_listening_pollfd(listen_pollfd, &my_addr) < 0)
-        pthread_exit((void *) EXIT_FAILURE);
-//    puts("Inited lsd");
-//    init_sigint_handler();
-#ifdef THREADPOOL
-    sem_init(&semaphore, 0, 0);
-#endif
-//    puts("Initializing thread pool");
-    thread_pool_init(&thread_pool, THREAD_NUM);
-//    puts("Thr");
-
-    if (thread_pool_add_task(&thread_pool, poll_task, (void *) listen_pollfd) == 0) {
-#ifdef SINGLETHREAD
-        thread_pool_run(&thread_pool);
-#endif
-    }
-//    puts("Task added");
-    thread_pool_destroy(&thread_pool);
-    arrayset_free(&clients, free_client);
-    arrayset_free(&servers, free_server);
-    cache_map_destroy(&map);
-    if (close(listen_pollfd->fd)) {
-        perror("Couldn't close listening socket: ");
+int reactor_init(struct reactor *reactor, struct proxy_config *config) {
+    int listen_socket, wakeup_fd;
+    //connections are removed one by one under the locks of the reactor, the stored slots make it O(1)
+    arrayset_init_indexed(&reactor->clients, offsetof(struct client, set_index));
+    arrayset_init_indexed(&reactor->servers, offsetof(struct server, set_index));
+    reactor->woken = NULL;
+    fifo_init(&reactor->connected);
+    timer_wheel_init(&reactor->timers, current_time_ms());
+    reactor->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (reactor->reserve_fd < 0) {
+        LOG_WARN("Couldn't open reserve descriptor: %s", strerror(errno));
+    }
+    if (event_loop_init(&reactor->loop, config->backend, reactor_mode == REACTOR_MODE_POOL) < 0) return -1;
+    listen_socket = init_listening_socket(&config->listen_addr, SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                          reactor_mode == REACTOR_MODE_MULTI);
+    if (listen_socket < 0) {
+        event_loop_destroy(&reactor->loop);
+        return -1;
+    }
+    event_source_init(&reactor->listen_source, listen_socket, POLLIN, handle_accept, reactor);
+    if (event_loop_add(&reactor->loop, &reactor->listen_source) < 0) {
+        close(listen_socket);
+        event_loop_destroy(&reactor->loop);
+        return -1;
+    }
+    MUTEX_INIT(&reactor->wakeup_mutex);
+    if ((wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        LOG_ERROR("eventfd() failed: %s", strerror(errno));
+        close(listen_socket);
+        event_loop_destroy(&reactor->loop);
+        return -1;
+    }
+    event_source_init(&reactor->wakeup_source, wakeup_fd, POLLIN, handle_wakeup, reactor);
+    if (event_loop_add(&reactor->loop, &reactor->wakeup_source) < 0) {
+        close(wakeup_fd);
+        close(listen_socket);
+        event_loop_destroy(&reactor->loop);
+        return -1;
+    }
+    MUTEX_INIT(&reactor->client_mutex);
+    MUTEX_INIT(&reactor->server_mutex);
+    return 0;
+}
+
+void reactor_destroy(struct reactor *reactor) {
+    struct fifo_link *link;
+    struct server *server;
+    arrayset_free(&reactor->clients, free_client);
+    arrayset_free(&reactor->servers, free_server);
+    //connect pool is destroyed by now, servers it connected after the reactor stopped are not in the loop
+    while ((link = fifo_pop(&reactor->connected)) != NULL) {
+        server = FIFO_ENTRY(link, struct server, link);
+        destroy_server(server->args);
+        free(server);
+    }
+    event_loop_remove(&reactor->loop, &reactor->listen_source);
+    event_loop_remove(&reactor->loop, &reactor->wakeup_source);
+    close(reactor->wakeup_source.fd);
+    event_loop_destroy(&reactor->loop);
+    timer_wheel_destroy(&reactor->timers);
+    if (reactor->reserve_fd >= 0) close(reactor->reserve_fd);
+    if (close(reactor->listen_source.fd)) {
+        LOG_ERROR("Couldn't close listening socket: %s", strerror(errno));
     } else {
-        puts("Listening socket closed");
+        LOG_INFO("Listening socket closed");
     }
-    pthread_exit((void *) NULL);
+    MUTEX_DESTROY(&reactor->wakeup_mutex);
+    MUTEX_DESTROY(&reactor->client_mutex);
+    MUTEX_DESTROY(&reactor->server_mutex);
 }
 
-void sigint_handler(int signum) { running = 0; }
+int get_reactor_num(struct proxy_config *config) {
+    long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactor_mode != REACTOR_MODE_MULTI) return 1;
+    if (config->thread_num > 0) return config->thread_num;
+    if (DEFAULT_REACTOR_NUM > 0) return DEFAULT_REACTOR_NUM;
+    return (cpu_num > 0 ? (int) cpu_num : 1);
+}
 
-int init_sigint_handler() {
-    signal(SIGINT, sigint_handler);
-    return 0;
+void run_multireactor() {
+    int i, res;
+    LOG_INFO("Starting %d reactors", reactor_num);
+    for (i = 0; i < reactor_num; i++) {
+        if ((res = pthread_create(&reactors[i].thread, NULL, reactor_thread, reactors + i)) != 0) {
+            LOG_ERROR("Couldn't create reactor thread: %s", strerror(res));
+            running = 0;
+            break;
+        }
+    }
+    while (--i >= 0) {
+        pthread_join(reactors[i].thread, NULL);
+    }
 }
 
-int handle_args(int argc, char *argv[], struct sockaddr_in *my_addr) {
-    int listen_port;
-    if (argc == 1) {
-        fprintf(stderr, "Usage: %s listen_port\n", argv[0]);
-        return -1;
+/*
+ * Single threaded pool has no threads, the main thread polls and runs every queued task before the next poll,
+ * otherwise the high priority poll_task() would block the handlers queued before it for the whole wait.
+ * */
+void run_thread_pool(struct proxy_config *config) {
+    int thread_num = (reactor_mode == REACTOR_MODE_SINGLE ? 0 :
+                      config->thread_num > 0 ? config->thread_num : DEFAULT_THREAD_NUM);
+    struct thread_pool_task poll = {poll_task, reactors};
+    int max_thread_num = (thread_num == 0 ? 0 :
+                          config->max_thread_num > 0 ? config->max_thread_num : DEFAULT_MAX_THREAD_NUM);
+    if (max_thread_num < thread_num) max_thread_num = thread_num;
+    if (thread_num > 0) LOG_INFO("Starting thread pool of %d..%d threads", thread_num, max_thread_num);
+    if (thread_num == 0 && pin_threads) pin_current_thread(0);
+    if (thread_pool_init(&thread_pool, thread_num, max_thread_num, pin_threads) != 0) {
+        LOG_ERROR("Couldn't start thread pool");
+        return;
     }
-    listen_port = atoi(argv[1]);
-    if (listen_port <= 0) {
-        fprintf(stderr, "listen_port should be a valid port\n");
-        return -1;
+    if (thread_num == 0) {
+        while (running) {
+            poll_task(reactors);
+            thread_pool_run(&thread_pool);
+        }
+    } else {
+        thread_pool_add_tasks(&thread_pool, &poll, 1, THREAD_POOL_PRIORITY_HIGH);
     }
-    memset(my_addr, 0, sizeof(struct sockaddr_in));
-    my_addr->sin_family = AF_INET;
-    my_addr->sin_addr.s_addr = htonl(INADDR_ANY);
-    my_addr->sin_port = htons(listen_port);
-    return 0;
+    thread_pool_destroy(&thread_pool);
 }
 
-int init_listening_pollfd(struct pollfd *pollfd, struct sockaddr_in *my_addr) {
-    int enable = 1;
-    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_socket == -1) {
-        fprintf(stderr, "Error: socket() failed with %s\n", strerror(errno));
-        return -1;
+int run_reactors(struct proxy_config *config, int mode) {
+    int i, res = -1;
+    reactor_mode = mode;
+    pin_threads = config->pin_threads;
+    if (raise_open_files_limit() < 0) {
+        LOG_WARN("Couldn't raise the limit of open files: %s", strerror(errno));
     }
-    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
+    reactor_num = get_reactor_num(config);
+    reactors = (struct reactor *) calloc(reactor_num, sizeof(struct reactor));
+    if (reactors == NULL) return -1;
+    for (i = 0; i < reactor_num; i++) {
+        if (reactor_init(reactors + i, config) < 0) break;
     }
-    if (bind(listen_socket, (struct sockaddr *) my_addr, sizeof(*my_addr))) {
-        fprintf(stderr, "Error: bind() failed with %s\n", strerror(errno));
-        return -1;
+    if (i == reactor_num && reactor_mode == REACTOR_MODE_MULTI &&
+        thread_pool_init(&connect_pool, CONNECT_THREAD_NUM, CONNECT_MAX_THREAD_NUM, 0) != 0) {
+        LOG_ERROR("Couldn't start connect pool");
+    } else if (i == reactor_num) {
+        if (reactor_mode == REACTOR_MODE_MULTI) {
+            run_multireactor();
+        } else {
+            run_thread_pool(config);
+        }
+        //queued connects fail at once as the proxy isn't running
+        if (reactor_mode == REACTOR_MODE_MULTI) {
+            thread_pool_shut_down(&connect_pool, 0);
+            thread_pool_destroy(&connect_pool);
+        }
+        res = 0;
     }
-    if (listen(listen_socket, BACKLOG)) {
-        fprintf(stderr, "Error: listen() failed with %s\n", strerror(errno));
-        return -1;
+    reactor_num = i;
+    for (i = 0; i < reactor_num; i++) {
+        reactor_destroy(reactors + i);
+    }
+    free(reactors);
+    return res;
+}
+
+int run_singlethread_engine(struct proxy_config *config) {
+    return run_reactors(config, REACTOR_MODE_SINGLE);
+}
+
+int run_threadpool_engine(struct proxy_config *config) {
+    return run_reactors(config, REACTOR_MODE_POOL);
+}
+
+int run_multireactor_engine(struct proxy_config *config) {
+    return run_reactors(config, REACTOR_MODE_MULTI);
+}
+
+struct engine singlethread_engine = {"singlethread", &no_lock_ops, run_singlethread_engine};
+struct engine threadpool_engine = {"threadpool", &pthread_lock_ops, run_threadpool_engine};
+struct engine multireactor_engine = {"multireactor", &pthread_lock_ops, run_multireactor_engine};
+
+//connection tables size themselves from RLIMIT_NOFILE, so the soft limit is raised to the hard one
+int raise_open_files_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return -1;
+    if (limit.rlim_cur != limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) return -1;
     }
-    pollfd->fd = listen_socket;
-    pollfd->events = POLLIN;
-    pollfd->revents = 0;
+    LOG_INFO("Limit of open files: %llu", (unsigned long long) limit.rlim_cur);
     return 0;
 }
-#endif
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0) return -1;
+    //timeout of io_uring_enter() needs EXT_ARG, poll and CQ overflow handling need NODROP
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                              ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+    sq_ring = (char *) ring->sq_ring;
+    cq_ring = (char *) ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+//kernel moves the head while it submits, so the queued SQEs are the ones between head and tail
+unsigned uring_queued(struct uring *ring) {
+    return __atomic_load_n(ring->sq_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_submit(struct uring *ring) {
+    int res;
+    while ((res = io_uring_enter(ring->fd, uring_queued(ring), 0, 0, NULL, 0)) < 0 && errno == EINTR);
+    return (res < 0 ? -1 : 0);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned index;
+    struct io_uring_sqe *sqe;
+    if (uring_queued(ring) == ring->entries) {
+        if (uring_submit(ring) < 0 || uring_queued(ring) == ring->entries) return NULL;
+    }
+    index = *ring->sq_tail & *ring->sq_mask;
+    sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+void uring_queue_sqe(struct uring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+int uring_submit_and_wait(struct uring *ring, int timeout) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (__u64) (uintptr_t) &ts;
+    if (io_uring_enter(ring->fd, uring_queued(ring), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg)) < 0) {
+        //timeout and signals are not errors, completions are looked at anyway
+        return (errno == ETIME || errno == EINTR ? 0 : -1);
+    }
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return ring->cqes + (head & *ring->cq_mask);
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_destroy(struct uring *ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
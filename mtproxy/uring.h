@@ -0,0 +1,54 @@
+/*
+ * Minimal io_uring wrapper over the raw system calls, liburing is not required.
+ * Only what the event loop needs: getting SQEs, submitting them together with waiting
+ * for completions in one io_uring_enter() and walking the completion queue.
+ * Filling SQEs is not thread safe, the caller locks it. Submitting and waiting may be done
+ * by other threads at the same time, they submit everything queued so far.
+ * */
+#ifndef PROXY_URING_H
+#define PROXY_URING_H
+
+#include "consts.h"
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;                      //equal to sq_ring if the kernel maps both rings at once
+    size_t cq_ring_size;
+};
+
+//returns -1 if the kernel doesn't support io_uring or the features the proxy needs
+int uring_init(struct uring *ring, unsigned entries);
+
+//returns zeroed SQE, submits the queue first if it is full, returns NULL on error
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+//makes the SQE returned by uring_get_sqe() visible to the kernel
+void uring_queue_sqe(struct uring *ring);
+
+int uring_submit(struct uring *ring);
+
+//submits queued SQEs and waits up to timeout milliseconds for at least one completion
+int uring_submit_and_wait(struct uring *ring, int timeout);
+
+//returns the oldest unseen completion or NULL, uring_cqe_seen() should be called after it is handled
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+void uring_destroy(struct uring *ring);
+
+#endif //PROXY_URING_H